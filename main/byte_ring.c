@@ -0,0 +1,60 @@
+/*  Ring of bytes.
+ *
+ *  Holds data the TCP bridge could not send to a client yet. Indexes are free running and masked on access,
+ *  so a full ring and an empty ring can be told apart without a spare byte.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "byte_ring.h"
+
+
+bool byte_ring_init(byte_ring_t *ring, size_t size)
+{
+    if (size < 2 || (size & (size - 1)) != 0) {
+        return false;
+    }
+
+    ring->data = (uint8_t *)malloc(size);
+    if (ring->data == NULL) {
+        return false;
+    }
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    return true;
+}
+
+void byte_ring_free(byte_ring_t *ring)
+{
+    free(ring->data);
+    ring->data = NULL;
+}
+
+size_t byte_ring_write(byte_ring_t *ring, const void *data, size_t len)
+{
+    len = MIN(len, ring->mask + 1 - byte_ring_used(ring));
+
+    // In two parts if the data wraps around the end of the ring
+    size_t start = ring->head & ring->mask;
+    size_t first = MIN(len, ring->mask + 1 - start);
+    memcpy(ring->data + start, data, first);
+    memcpy(ring->data, (const uint8_t *)data + first, len - first);
+
+    ring->head += len;
+    return len;
+}
+
+size_t byte_ring_peek(const byte_ring_t *ring, const uint8_t **data)
+{
+    size_t start = ring->tail & ring->mask;
+    *data = ring->data + start;
+    return MIN(byte_ring_used(ring), ring->mask + 1 - start);
+}
+
+void byte_ring_consume(byte_ring_t *ring, size_t len)
+{
+    ring->tail += MIN(len, byte_ring_used(ring));
+}
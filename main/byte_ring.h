@@ -0,0 +1,53 @@
+#pragma once
+#ifndef BYTE_RING_H_INCLUDED
+#define BYTE_RING_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Ring of bytes, for data waiting to be sent to a socket.
+ * Not locked, the caller serialises access. Size must be a power of two. The ring can hold size bytes. */
+typedef struct byte_ring {
+    uint8_t *data;
+    size_t mask;
+    size_t head;                /* free running, next byte written at head & mask */
+    size_t tail;                /* free running, next byte read at tail & mask */
+} byte_ring_t;
+
+/* Allocate ring storage. Returns false if size is not a power of two or allocation failed */
+bool byte_ring_init(byte_ring_t *ring, size_t size);
+
+/* Free ring storage */
+void byte_ring_free(byte_ring_t *ring);
+
+/* Append as much of data as there is room for. Returns the number of bytes stored */
+size_t byte_ring_write(byte_ring_t *ring, const void *data, size_t len);
+
+/* Oldest bytes in the ring that are contiguous in memmory. Returns their number, 0 if the ring is empty */
+size_t byte_ring_peek(const byte_ring_t *ring, const uint8_t **data);
+
+/* Remove len bytes from the start of the ring, after they have been sent */
+void byte_ring_consume(byte_ring_t *ring, size_t len);
+
+/* Number of bytes in the ring */
+static inline size_t byte_ring_used(const byte_ring_t *ring)
+{
+    return ring->head - ring->tail;
+}
+
+/* Remove all bytes */
+static inline void byte_ring_clear(byte_ring_t *ring)
+{
+    ring->tail = ring->head;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* BYTE_RING_H_INCLUDED */
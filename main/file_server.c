@@ -22,7 +22,13 @@
 #include "cJSON.h"
 
 #include "sdmmc.h"
+#include "lz4_frame.h"
+#include "sd_writer.h"
 #include "uart_tcp_server.h"
+#include "uart_store.h"
+#include "uart_capture.h"
+#include "sensor_poll.h"
+#include "uart_arbiter.h"
 #include "wifi_manager.h"
 #include "file_server.h"
 
@@ -52,6 +58,8 @@ static const char *TAG = "http_server";
 /* FreeRTOS handle used for connection notifications between this task and the wi-fi manager */
 static TaskHandle_t xTaskToNotify = NULL;
 
+static httpd_handle_t server = NULL;
+
 /* Status for firmware update*/
 static int flash_status;
 
@@ -447,6 +455,153 @@ static esp_err_t connect_status_handler(httpd_req_t *req)
 	}
 }
 
+/* Handler for the latest segments of files rotated by the SPI receiver, newest first.
+ * Finished segments can be downloaded while the current segment is still being written. */
+static esp_err_t segments_handler(httpd_req_t *req)
+{
+    sd_segment_t *list = malloc(SD_SEGMENT_EVENTS * sizeof(sd_segment_t));
+    if (list == NULL)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+    size_t count = sd_writer_get_segments(list, SD_SEGMENT_EVENTS);
+
+    cJSON *root = cJSON_CreateArray();
+    for (size_t i = 0; i < count; i++)
+    {
+        cJSON *item = cJSON_CreateObject();
+        // Path as used in the web interface, without the mount point
+        cJSON_AddStringToObject(item, "path", list[i].path + sizeof(SD_MOUNT) - 1);
+        cJSON_AddNumberToObject(item, "segment", list[i].segment);
+        cJSON_AddStringToObject(item, "state", list[i].state == SD_SEGMENT_FINISHED ? "finished" : "writing");
+        cJSON_AddNumberToObject(item, "size", list[i].size);
+        cJSON_AddItemToArray(root, item);
+    }
+    free(list);
+
+    char *json = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    if (json == NULL)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store, no-cache, must-revalidate, max-age=0");
+    httpd_resp_sendstr(req, json);
+    free(json);
+    return ESP_OK;
+}
+
+/* Handler for the uart output stored while no TCP client was connected: replay progress and dropped bytes */
+static esp_err_t uart_store_handler(httpd_req_t *req)
+{
+    uart_store_stats_t stats;
+    uart_store_get_stats(&stats);
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "stored", stats.stored);
+    cJSON_AddNumberToObject(root, "replayed", stats.replayed);
+    cJSON_AddNumberToObject(root, "dropped", stats.dropped);
+    cJSON_AddNumberToObject(root, "pending", stats.pending);
+    cJSON_AddNumberToObject(root, "replay_sent", stats.replay_sent);
+    cJSON_AddBoolToObject(root, "replaying", stats.replaying);
+    cJSON_AddNumberToObject(root, "discarded", uart_arbiter_discarded());
+
+    char *json = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    if (json == NULL)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store, no-cache, must-revalidate, max-age=0");
+    httpd_resp_sendstr(req, json);
+    free(json);
+    return ESP_OK;
+}
+
+/* Send the sensor uart baud rate as JSON. ok is false if a requested change failed */
+static esp_err_t send_uart_baud(httpd_req_t *req, bool ok)
+{
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "baud", uart_arbiter_get_baud());
+    cJSON_AddNumberToObject(root, "default", UART_BAUD_DEFAULT);
+    cJSON_AddBoolToObject(root, "flow_control", UART_HW_FLOW_CTRL);
+    cJSON_AddBoolToObject(root, "ok", ok);
+
+    char *json = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    if (json == NULL)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store, no-cache, must-revalidate, max-age=0");
+    httpd_resp_sendstr(req, json);
+    free(json);
+    return ESP_OK;
+}
+
+/* Handler for changing the sensor uart baud rate, for a bulk transfer. POST /uart_baud with the rate in the
+ * X-Custom-baud header, like /connect, so it can not be sent by a link or a form on another site.
+ * The bridge goes back to the default when its last client disconnects */
+static esp_err_t uart_baud_post_handler(httpd_req_t *req)
+{
+    char value[12];
+    size_t len = httpd_req_get_hdr_value_len(req, "X-Custom-baud");
+    if (len == 0 || len >= sizeof(value) ||
+        httpd_req_get_hdr_value_str(req, "X-Custom-baud", value, sizeof(value)) != ESP_OK)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing baud rate");
+        return ESP_FAIL;
+    }
+
+    char *end;
+    unsigned long baud = strtoul(value, &end, 10);
+    if (end == value || *end != '\0' || baud < UART_BAUD_MIN || baud > UART_BAUD_MAX)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid baud rate");
+        return ESP_FAIL;
+    }
+    return send_uart_baud(req, uart_arbiter_set_baud(baud, UART_BAUD_WAIT_MS) == ESP_OK);
+}
+
+/* Handler for the latest sensor readings. Clients that send the ETag they have get 304 until the readings change */
+static esp_err_t readings_handler(httpd_req_t *req)
+{
+    char etag[SENSOR_POLL_ETAG_SIZE];
+    char *json = sensor_poll_get_json(etag, sizeof(etag));
+    if (json == NULL)
+    {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Sensor polling is not running");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+    char match[64];
+    size_t match_len = httpd_req_get_hdr_value_len(req, "If-None-Match");
+    if (match_len > 0 && match_len < sizeof(match) &&
+        httpd_req_get_hdr_value_str(req, "If-None-Match", match, sizeof(match)) == ESP_OK &&
+        strstr(match, etag) != NULL)
+    {
+        free(json);
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_send(req, NULL, 0);
+        return ESP_OK;
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, json);
+    free(json);
+    return ESP_OK;
+}
+
 /* Handler for disconnecting from a network */
 static esp_err_t disconnect_handler(httpd_req_t *req)
 {
@@ -562,6 +717,20 @@ static esp_err_t upgrade_resp_html(httpd_req_t *req) //const char *dirpath
     return ESP_OK;
 }
 
+/* LZ4 compressed files are recognized by their extension */
+static bool is_lz4_file(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 4 && strcasecmp(name + len - 4, ".lz4") == 0;
+}
+
+/* Uart capture files are recognized by their extension */
+static bool is_capture_file(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 4 && strcasecmp(name + len - 4, UART_CAPTURE_EXT) == 0;
+}
+
 /* Send HTTP response with a run-time generated html consisting of
  * a list of all files and folders under the requested path. */
 static esp_err_t http_resp_dir_html(httpd_req_t *req, const char *dirpath)
@@ -719,6 +888,11 @@ static esp_err_t http_resp_dir_html(httpd_req_t *req, const char *dirpath)
             entrytype = "file";
 
             strlcpy(entrypath + dirpath_len, entry->d_name, sizeof(entrypath) - dirpath_len);
+            if (sd_writer_is_writing(entrypath))
+            {
+                /* Current segment of a file rotated by the SPI receiver */
+                entrytype = "writing";
+            }
             if (stat(entrypath, &entry_stat) == -1)
             {
                 ESP_LOGE(TAG, "Failed to stat %s : %s", entrytype, entry->d_name);
@@ -738,7 +912,24 @@ static esp_err_t http_resp_dir_html(httpd_req_t *req, const char *dirpath)
             httpd_resp_sendstr_chunk(req, "\">"  //UTF character for file icon &#128462 
                                             "<img src=\"/file.png\" width=\"16\" height=\"16\">");
             httpd_resp_sendstr_chunk(req, entry->d_name);
-            httpd_resp_sendstr_chunk(req, "</a></td><td>");
+            httpd_resp_sendstr_chunk(req, "</a>");
+            if (is_lz4_file(entry->d_name))
+            {
+                /* Compressed files can also be downloaded decompressed */
+                httpd_resp_sendstr_chunk(req, " <a href=\"");
+                httpd_resp_sendstr_chunk(req, req->uri);
+                httpd_resp_sendstr_chunk(req, entry->d_name);
+                httpd_resp_sendstr_chunk(req, "?decompress\">(decompressed)</a>");
+            }
+            else if (is_capture_file(entry->d_name))
+            {
+                /* Uart captures can also be downloaded as text */
+                httpd_resp_sendstr_chunk(req, " <a href=\"");
+                httpd_resp_sendstr_chunk(req, req->uri);
+                httpd_resp_sendstr_chunk(req, entry->d_name);
+                httpd_resp_sendstr_chunk(req, "?text\">(text)</a>");
+            }
+            httpd_resp_sendstr_chunk(req, "</td><td>");
             httpd_resp_sendstr_chunk(req, entrytype);
             httpd_resp_sendstr_chunk(req, "</td><td data-sort=\"");
             httpd_resp_sendstr_chunk(req, entrysize);
@@ -954,6 +1145,274 @@ static const char *get_path_from_uri(char *dest, const char *base_path, const ch
     return dest + base_pathlen;
 }
 
+static esp_err_t lz4_send_chunk(void *ctx, const uint8_t *data, size_t len)
+{
+    return httpd_resp_send_chunk((httpd_req_t *)ctx, (const char *)data, len);
+}
+
+/* Send a LZ4 compressed file decompressed, with the .lz4 extension removed from the file name.
+ * Decompression is done block by block, so compressed blocks can be at most SCRATCH_BUFSIZE.
+ * Files written over SPI use 4 KB blocks. */
+static esp_err_t download_decompressed(httpd_req_t *req, const char *filepath)
+{
+    char disposition[FOLDER_PATH];
+    const char *name = strrchr(filepath, '/') + 1;
+    int name_len = strlen(name) - (sizeof(".lz4") - 1);
+
+    FILE *fd = fopen(filepath, "rb");
+    if (!fd)
+    {
+        ESP_LOGE(TAG, "Failed to read existing file : %s", filepath);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
+        return ESP_FAIL;
+    }
+    uint8_t *out = malloc(SCRATCH_BUFSIZE);
+    if (out == NULL)
+    {
+        fclose(fd);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Sending file decompressed : %s", filepath);
+
+    snprintf(disposition, sizeof(disposition), "attachment; filename=\"%.*s\"", name_len, name);
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "Content-Disposition", disposition);
+    setvbuf(fd, NULL, _IOFBF, READ_BUF);
+
+    uint8_t *in = (uint8_t *)((struct file_server_data *)req->user_ctx)->scratch;
+    esp_err_t err = lz4f_decompress_file(fd, in, SCRATCH_BUFSIZE, out, SCRATCH_BUFSIZE, lz4_send_chunk, req);
+    fclose(fd);
+    free(out);
+
+    if (err != ESP_OK)
+    {
+        /* Headers are already sent, so the only way to tell the client is to abort the transfer */
+        ESP_LOGE(TAG, "Decompressed download of %s failed: %s", filepath, esp_err_to_name(err));
+        httpd_resp_sendstr_chunk(req, NULL);
+        return ESP_FAIL;
+    }
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+static esp_err_t capture_send_text(void *ctx, const char *text, size_t len)
+{
+    return httpd_resp_send_chunk((httpd_req_t *)ctx, text, len);
+}
+
+/* Send a uart capture file as text, one line per record, as name.txt */
+static esp_err_t download_capture_text(httpd_req_t *req, const char *filepath)
+{
+    char disposition[FOLDER_PATH];
+    const char *name = strrchr(filepath, '/') + 1;
+    int name_len = strlen(name) - (sizeof(UART_CAPTURE_EXT) - 1);
+
+    FILE *fd = fopen(filepath, "rb");
+    if (!fd)
+    {
+        ESP_LOGE(TAG, "Failed to read existing file : %s", filepath);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
+        return ESP_FAIL;
+    }
+    uint8_t *in = malloc(UART_CAPTURE_BATCH);
+    if (in == NULL)
+    {
+        fclose(fd);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Sending capture as text : %s", filepath);
+
+    snprintf(disposition, sizeof(disposition), "attachment; filename=\"%.*s.txt\"", name_len, name);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_set_hdr(req, "Content-Disposition", disposition);
+    setvbuf(fd, NULL, _IOFBF, READ_BUF);
+
+    char *out = ((struct file_server_data *)req->user_ctx)->scratch;
+    esp_err_t err = uart_capture_to_text(fd, in, out, SCRATCH_BUFSIZE, capture_send_text, req);
+    fclose(fd);
+    free(in);
+
+    if (err != ESP_OK)
+    {
+        /* Headers are already sent, so the only way to tell the client is to abort the transfer */
+        ESP_LOGE(TAG, "Text download of %s failed: %s", filepath, esp_err_to_name(err));
+        httpd_resp_sendstr_chunk(req, NULL);
+        return ESP_FAIL;
+    }
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+/* Offset of the last record at or before time in a file written with SPI_OPEN_TIMESTAMP, found by a binary search of
+ * the time index beside it. Records from there on are read until the time is reached. 0 if there is no index. */
+static long index_find(const char *filepath, int64_t time)
+{
+    char path[FILE_PATH_MAX + sizeof(SD_INDEX_SUFFIX)];
+    sd_index_entry_t entry;
+    struct stat st;
+    long offset = 0;
+
+    snprintf(path, sizeof(path), "%s%s", filepath, SD_INDEX_SUFFIX);
+    if (stat(path, &st) != 0)
+    {
+        return 0;
+    }
+    FILE *fd = fopen(path, "rb");
+    if (fd == NULL)
+    {
+        return 0;
+    }
+    long low = 0;
+    long high = st.st_size / sizeof(entry) - 1;
+    while (low <= high)
+    {
+        long mid = (low + high) / 2;
+        if (fseek(fd, mid * sizeof(entry), SEEK_SET) != 0 || fread(&entry, sizeof(entry), 1, fd) != 1)
+        {
+            break;
+        }
+        if (entry.time <= time)
+        {
+            offset = entry.offset;
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    fclose(fd);
+    return offset;
+}
+
+/* Send the records of a file written with SPI_OPEN_TIMESTAMP received in [from, to), micro seconds since 1970.
+ * Only the data is sent, or the records with their headers if framed. */
+static esp_err_t download_time_range(httpd_req_t *req, const char *filepath, int64_t from, int64_t to, bool framed)
+{
+    char *chunk = ((struct file_server_data *)req->user_ctx)->scratch;
+    sd_record_header_t header;
+    size_t fill = 0;
+    size_t sent = 0;
+    esp_err_t err = ESP_OK;
+
+    FILE *fd = fopen(filepath, "rb");
+    if (!fd)
+    {
+        ESP_LOGE(TAG, "Failed to read existing file : %s", filepath);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
+        return ESP_FAIL;
+    }
+    long offset = index_find(filepath, from);
+    ESP_LOGI(TAG, "Sending time range of %s from offset %li", filepath, offset);
+
+    httpd_resp_set_type(req, "application/octet-stream");
+    setvbuf(fd, NULL, _IOFBF, READ_BUF);
+    fseek(fd, offset, SEEK_SET);
+
+    /* The file ends at the first incomplete record or at preallocated space */
+    while (fread(&header, sizeof(header), 1, fd) == 1 && header.magic == SD_RECORD_MAGIC && header.time < to)
+    {
+        if (header.time < from)
+        {
+            if (fseek(fd, header.len, SEEK_CUR) != 0)
+            {
+                break;
+            }
+            continue;
+        }
+        size_t size = header.len + (framed ? sizeof(header) : 0);
+        if (fill + size > SCRATCH_BUFSIZE && fill > 0)
+        {
+            err = httpd_resp_send_chunk(req, chunk, fill);
+            sent += fill;
+            fill = 0;
+            if (err != ESP_OK)
+            {
+                break;
+            }
+        }
+        if (framed)
+        {
+            memcpy(chunk + fill, &header, sizeof(header));
+            fill += sizeof(header);
+        }
+        /* Records longer than the scratch buffer are sent in parts */
+        size_t remaining = header.len;
+        while (remaining > 0)
+        {
+            size_t len = fread(chunk + fill, 1, MIN(remaining, SCRATCH_BUFSIZE - fill), fd);
+            if (len == 0)
+            {
+                break;
+            }
+            fill += len;
+            remaining -= len;
+            if (fill == SCRATCH_BUFSIZE)
+            {
+                err = httpd_resp_send_chunk(req, chunk, fill);
+                sent += fill;
+                fill = 0;
+                if (err != ESP_OK)
+                {
+                    break;
+                }
+            }
+        }
+        if (err != ESP_OK || remaining > 0)
+        {
+            break;
+        }
+    }
+    fclose(fd);
+
+    if (err == ESP_OK && fill > 0)
+    {
+        err = httpd_resp_send_chunk(req, chunk, fill);
+        sent += fill;
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "File sending failed!");
+        httpd_resp_sendstr_chunk(req, NULL);
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Time range sent: %u bytes", sent);
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+/* Time range of a download query: "from=" and "to=" in seconds since 1970, or "last=" seconds before now.
+ * "framed=1" keeps the record headers. Returns false if the query has no time range. */
+static bool parse_time_range(const char *query, int64_t *from, int64_t *to, bool *framed)
+{
+    char value[24];
+    bool range = false;
+
+    *from = 0;
+    *to = INT64_MAX;
+    if (httpd_query_key_value(query, "from", value, sizeof(value)) == ESP_OK)
+    {
+        *from = strtoll(value, NULL, 10) * 1000000;
+        range = true;
+    }
+    if (httpd_query_key_value(query, "to", value, sizeof(value)) == ESP_OK)
+    {
+        *to = strtoll(value, NULL, 10) * 1000000;
+        range = true;
+    }
+    if (httpd_query_key_value(query, "last", value, sizeof(value)) == ESP_OK)
+    {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        *from = (int64_t)(now.tv_sec - strtoll(value, NULL, 10)) * 1000000;
+        range = true;
+    }
+    *framed = httpd_query_key_value(query, "framed", value, sizeof(value)) == ESP_OK && strcmp(value, "1") == 0;
+    return range;
+}
+
 /* Handler to download a file kept on the server */
 static esp_err_t download_get_handler(httpd_req_t *req)
 {
@@ -1024,7 +1483,43 @@ static esp_err_t download_get_handler(httpd_req_t *req)
         else if (strcmp(filename, "/?connect_status") == 0)
         {
             return connect_status_handler(req);
-        }   
+        }
+        else if (strcmp(filename, "/?segments") == 0)
+        {
+            return segments_handler(req);
+        }
+        else if (strcmp(filename, "/?uart_store") == 0)
+        {
+            return uart_store_handler(req);
+        }
+        else if (strcmp(filename, "/?readings") == 0)
+        {
+            return readings_handler(req);
+        }
+        else if (strcmp(filename, "/?uart_baud") == 0)
+        {
+            return send_uart_baud(req, true);
+        }
+        /* Download options are given as query after the file name */
+        char *query = strchr(filepath, '?');
+        if (query != NULL)
+        {
+            *query++ = '\0';
+            if (stat(filepath, &file_stat) == 0 && strcmp(query, "decompress") == 0 && is_lz4_file(filepath))
+            {
+                return download_decompressed(req, filepath);
+            }
+            if (stat(filepath, &file_stat) == 0 && strcmp(query, "text") == 0 && is_capture_file(filepath))
+            {
+                return download_capture_text(req, filepath);
+            }
+            int64_t from, to;
+            bool framed;
+            if (stat(filepath, &file_stat) == 0 && parse_time_range(query, &from, &to, &framed))
+            {
+                return download_time_range(req, filepath, from, to, framed);
+            }
+        }
         ESP_LOGE(TAG, "Failed to stat file : %s", filepath);
         /* Respond with 404 Not Found */
         httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File does not exist");
@@ -1807,6 +2302,10 @@ static esp_err_t http_server_post_handler(httpd_req_t *req)
     {
         return format_handler(req);
     }
+    else if(strcmp(uri, "/uart_baud") == 0) // Handler for changing the sensor uart baud rate
+    {
+        return uart_baud_post_handler(req);
+    }
     /*else if(strcmp(uri, "/custom_request") == 0)
     {
         return custom_handler(req);
@@ -1848,7 +2347,6 @@ esp_err_t start_file_server(const char *base_path)
     strlcpy(server_data->base_path, base_path,
             sizeof(server_data->base_path));
 
-    httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.lru_purge_enable = true;
     config.max_open_sockets = 6;
@@ -1899,3 +2397,13 @@ esp_err_t start_file_server(const char *base_path)
 
     return ESP_OK;
 }
+
+void stop_file_server(void)
+{
+    if (server != NULL)
+    {
+        httpd_stop(server);
+        server = NULL;
+        ESP_LOGI(TAG, "HTTP Server stopped");
+    }
+}
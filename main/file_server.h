@@ -20,6 +20,9 @@ void xTask_connection_give();//( UBaseType_t uxIndexToNotify );
 /* Start the http server main task */
 esp_err_t start_file_server(const char *base_path);
 
+/* Stop the http server, before deep sleep. Waits for requests in progress */
+void stop_file_server(void);
+
 
 
 #ifdef __cplusplus
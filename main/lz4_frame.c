@@ -0,0 +1,395 @@
+/*  Minimal LZ4 frame format writer and reader.
+ *
+ *  The compressor is a greedy single pass match finder with a small hash table, enough to
+ *  shrink text logs and repetitive sensor data several times at SPI speed. Every block is
+ *  compressed on its own (independent blocks), so neither side has to keep a history window.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "lz4_frame.h"
+
+
+#define LZ4F_MAGIC              0x184D2204
+#define LZ4F_SKIPPABLE_MAGIC    0x184D2A50      /* Low 4 bits are free */
+#define LZ4F_UNCOMPRESSED_BIT   0x80000000
+
+/* Frame descriptor flags */
+#define LZ4F_VERSION            0x40
+#define LZ4F_BLOCK_INDEP        0x20
+#define LZ4F_BLOCK_CHECKSUM     0x10
+#define LZ4F_CONTENT_SIZE       0x08
+#define LZ4F_CONTENT_CHECKSUM   0x04
+#define LZ4F_DICT_ID            0x01
+#define LZ4F_BLOCK_MAX_64KB     0x40
+
+/* LZ4 block format limits */
+#define MIN_MATCH               4
+#define MF_LIMIT                12      /* Last match must start at least 12 bytes before end of block */
+#define LAST_LITERALS           5       /* Last 5 bytes of a block are always literals */
+
+
+static inline uint32_t read_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void write_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static inline uint32_t rotl32(uint32_t v, int r)
+{
+    return (v << r) | (v >> (32 - r));
+}
+
+/* xxHash32 of inputs shorter than 16 bytes, used for the frame header checksum */
+static uint32_t xxh32_short(const uint8_t *p, size_t len, uint32_t seed)
+{
+    const uint32_t P1 = 2654435761U, P2 = 2246822519U, P3 = 3266489917U, P4 = 668265263U, P5 = 374761393U;
+    uint32_t h = seed + P5 + (uint32_t)len;
+
+    for (; len >= 4; len -= 4, p += 4) {
+        h += read_le32(p) * P3;
+        h = rotl32(h, 17) * P4;
+    }
+    for (; len > 0; len--, p++) {
+        h += *p * P5;
+        h = rotl32(h, 11) * P1;
+    }
+    h ^= h >> 15;
+    h *= P2;
+    h ^= h >> 13;
+    h *= P3;
+    h ^= h >> 16;
+    return h;
+}
+
+size_t lz4f_frame_header(uint8_t *out)
+{
+    write_le32(out, LZ4F_MAGIC);
+    out[4] = LZ4F_VERSION | LZ4F_BLOCK_INDEP;
+    out[5] = LZ4F_BLOCK_MAX_64KB;
+    out[6] = (xxh32_short(out + 4, 2, 0) >> 8) & 0xFF;
+    return LZ4F_HEADER_SIZE;
+}
+
+size_t lz4f_end_mark(uint8_t *out)
+{
+    write_le32(out, 0);
+    return LZ4F_END_MARK_SIZE;
+}
+
+/* Write the extra bytes of a literal or match length of 15 or more */
+static uint8_t *write_length(uint8_t *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/* Compress to the raw LZ4 block format. Returns 0 if the result does not fit in cap bytes */
+static size_t compress_raw(const uint8_t *src, size_t len, uint8_t *dst, size_t cap, uint16_t *hash_table)
+{
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *iend = src + len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+    size_t lit;
+
+    // Positions are stored + 1, so 0 means empty
+    memset(hash_table, 0, LZ4_HASH_SIZE * sizeof(uint16_t));
+
+    if (len > MF_LIMIT) {
+        const uint8_t *mflimit = iend - MF_LIMIT;
+        const uint8_t *matchlimit = iend - LAST_LITERALS;
+
+        while (ip <= mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash32(seq);
+            size_t ref = hash_table[h];
+
+            hash_table[h] = (uint16_t)(ip - src + 1);
+            if (ref == 0 || read32(src + ref - 1) != seq) {
+                ip++;
+                continue;
+            }
+
+            const uint8_t *match = src + ref - 1;
+            while (ip > anchor && match > src && ip[-1] == match[-1]) {
+                ip--;
+                match--;
+            }
+            const uint8_t *end = ip + MIN_MATCH;
+            const uint8_t *m = match + MIN_MATCH;
+            while (end < matchlimit && *end == *m) {
+                end++;
+                m++;
+            }
+
+            lit = ip - anchor;
+            size_t match_len = end - ip - MIN_MATCH;
+            if (op + 1 + lit + lit / 255 + 1 + 2 + match_len / 255 + 1 > oend) {
+                return 0;
+            }
+
+            uint8_t *token = op++;
+            if (lit >= 15) {
+                *token = 15 << 4;
+                op = write_length(op, lit - 15);
+            } else {
+                *token = lit << 4;
+            }
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            uint16_t offset = ip - match;
+            *op++ = offset & 0xFF;
+            *op++ = offset >> 8;
+
+            if (match_len >= 15) {
+                *token |= 15;
+                op = write_length(op, match_len - 15);
+            } else {
+                *token |= match_len;
+            }
+            ip = anchor = end;
+        }
+    }
+
+    // Last literals
+    lit = iend - anchor;
+    if (op + 1 + lit + lit / 255 + 1 > oend) {
+        return 0;
+    }
+    if (lit >= 15) {
+        *op++ = 15 << 4;
+        op = write_length(op, lit - 15);
+    } else {
+        *op++ = lit << 4;
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - dst;
+}
+
+size_t lz4f_compress_block(const uint8_t *src, size_t len, uint8_t *dst, uint16_t *hash_table)
+{
+    size_t size = 0;
+
+    if (len > LZ4_MAX_BLOCK_SIZE) {
+        return 0;
+    }
+    // Only keep the compressed block if it is smaller
+    if (len > 0) {
+        size = compress_raw(src, len, dst + LZ4F_BLOCK_HEADER_SIZE, len - 1, hash_table);
+    }
+    if (size == 0) {
+        memcpy(dst + LZ4F_BLOCK_HEADER_SIZE, src, len);
+        write_le32(dst, len | LZ4F_UNCOMPRESSED_BIT);
+        return LZ4F_BLOCK_HEADER_SIZE + len;
+    }
+    write_le32(dst, size);
+    return LZ4F_BLOCK_HEADER_SIZE + size;
+}
+
+/* Read a length continued in following bytes. Returns false if the block ends first */
+static bool read_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t b;
+    do {
+        if (*ip >= iend) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+/* Decompress a raw LZ4 block. Returns decompressed size, or -1 if the block is corrupt or does not fit */
+static int decompress_raw(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == 15 && !read_length(&ip, iend, &lit)) {
+            return -1;
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+
+        // The last sequence has literals only
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !read_length(&ip, iend, &match_len)) {
+            return -1;
+        }
+        match_len += MIN_MATCH;
+        if (match_len > (size_t)(oend - op)) {
+            return -1;
+        }
+
+        // Byte copy, the match may overlap the output
+        const uint8_t *match = op - offset;
+        while (match_len--) {
+            *op++ = *match++;
+        }
+    }
+    return op - dst;
+}
+
+static bool read_exact(FILE *fd, void *buf, size_t len)
+{
+    return fread(buf, 1, len, fd) == len;
+}
+
+/* Decompress the blocks of one frame, after the magic number */
+static esp_err_t decompress_frame(FILE *fd, uint8_t *in, size_t in_size, uint8_t *out, size_t out_size,
+                                  lz4f_output_cb output, void *ctx)
+{
+    uint8_t desc[2];
+    uint8_t word[4];
+    esp_err_t err;
+
+    if (!read_exact(fd, desc, sizeof(desc)) || (desc[0] & 0xC0) != LZ4F_VERSION) {
+        return ESP_ERR_INVALID_VERSION;
+    }
+    // Linked blocks need a 64 KB history window
+    if (!(desc[0] & LZ4F_BLOCK_INDEP)) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    // Skip content size, dictionary ID and header checksum
+    long skip = 1;
+    if (desc[0] & LZ4F_CONTENT_SIZE) {
+        skip += 8;
+    }
+    if (desc[0] & LZ4F_DICT_ID) {
+        skip += 4;
+    }
+    if (fseek(fd, skip, SEEK_CUR) != 0) {
+        return ESP_FAIL;
+    }
+
+    while (1) {
+        size_t n = fread(word, 1, sizeof(word), fd);
+        if (n == 0) {
+            return ESP_OK;      // No end mark, the file was not closed after writing. All whole blocks are read.
+        }
+        if (n < sizeof(word)) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        uint32_t size = read_le32(word);
+        if (size == 0) {
+            break;      // End mark
+        }
+
+        if (size & LZ4F_UNCOMPRESSED_BIT) {
+            size &= ~LZ4F_UNCOMPRESSED_BIT;
+            while (size > 0) {
+                size_t len = size < in_size ? size : in_size;
+                if (!read_exact(fd, in, len)) {
+                    return ESP_ERR_INVALID_SIZE;
+                }
+                if ((err = output(ctx, in, len)) != ESP_OK) {
+                    return err;
+                }
+                size -= len;
+            }
+        } else {
+            if (size > in_size) {
+                return ESP_ERR_NO_MEM;
+            }
+            if (!read_exact(fd, in, size)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            int len = decompress_raw(in, size, out, out_size);
+            if (len < 0) {
+                return ESP_ERR_INVALID_CRC;
+            }
+            if ((err = output(ctx, out, len)) != ESP_OK) {
+                return err;
+            }
+        }
+
+        if ((desc[0] & LZ4F_BLOCK_CHECKSUM) && fseek(fd, 4, SEEK_CUR) != 0) {
+            return ESP_FAIL;
+        }
+    }
+
+    if ((desc[0] & LZ4F_CONTENT_CHECKSUM) && fseek(fd, 4, SEEK_CUR) != 0) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t lz4f_decompress_file(FILE *fd, uint8_t *in, size_t in_size, uint8_t *out, size_t out_size,
+                               lz4f_output_cb output, void *ctx)
+{
+    uint8_t word[4];
+    esp_err_t err;
+
+    // A file gets a new frame each time it is reopened for writing, so read frames until end of file
+    while (read_exact(fd, word, sizeof(word))) {
+        uint32_t magic = read_le32(word);
+
+        if ((magic & 0xFFFFFFF0) == LZ4F_SKIPPABLE_MAGIC) {
+            if (!read_exact(fd, word, sizeof(word)) || fseek(fd, read_le32(word), SEEK_CUR) != 0) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            continue;
+        }
+        if (magic != LZ4F_MAGIC) {
+            return ESP_ERR_INVALID_VERSION;
+        }
+        if ((err = decompress_frame(fd, in, in_size, out, out_size, output, ctx)) != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#ifndef LZ4_FRAME_H_INCLUDED
+#define LZ4_FRAME_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*  Minimal LZ4 frame format writer and reader.
+ *  Files are standard LZ4 frames (https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md) and can be
+ *  decompressed with the lz4 command line tool. Blocks are independent, so no history has to be kept in RAM.
+ */
+
+#define LZ4F_HEADER_SIZE        7       /* Frame header without content size and dictionary ID */
+#define LZ4F_BLOCK_HEADER_SIZE  4       /* Compressed size in front of each block */
+#define LZ4F_END_MARK_SIZE      4
+
+/* Hash table used by the compressor. 2 bytes per entry */
+#define LZ4_HASH_LOG            10
+#define LZ4_HASH_SIZE           (1 << LZ4_HASH_LOG)
+
+/* Largest block the compressor accepts */
+#define LZ4_MAX_BLOCK_SIZE      65535
+
+/* Worst case size of a compressed block of size n */
+#define LZ4_COMPRESS_BOUND(n)   ((n) + ((n) / 255) + 16)
+
+/* Called with decompressed data. Return ESP_OK to continue */
+typedef esp_err_t (*lz4f_output_cb)(void *ctx, const uint8_t *data, size_t len);
+
+
+/* Write a frame header to out (LZ4F_HEADER_SIZE bytes). Independent blocks, 64 KB maximum block size, no checksums */
+size_t lz4f_frame_header(uint8_t *out);
+
+/* Write the end mark of a frame to out (LZ4F_END_MARK_SIZE bytes) */
+size_t lz4f_end_mark(uint8_t *out);
+
+/* Compress src (at most LZ4_MAX_BLOCK_SIZE bytes) to a complete frame block in dst, including the block header.
+ * Data that does not compress is stored uncompressed.
+ * dst must hold LZ4F_BLOCK_HEADER_SIZE + len bytes. hash_table must hold LZ4_HASH_SIZE entries.
+ * Returns number of bytes written to dst */
+size_t lz4f_compress_block(const uint8_t *src, size_t len, uint8_t *dst, uint16_t *hash_table);
+
+/* Decompress all frames in a file. Blocks must be independent and fit in the buffers.
+ * in and out are work buffers, out_size is the largest decompressed block that can be handled.
+ * Returns ESP_OK when the whole file is decompressed */
+esp_err_t lz4f_decompress_file(FILE *fd, uint8_t *in, size_t in_size, uint8_t *out, size_t out_size,
+                               lz4f_output_cb output, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* LZ4_FRAME_H_INCLUDED */
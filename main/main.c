@@ -14,6 +14,7 @@
 #include "esp_netif.h"
 #include "mdns.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_ota_ops.h"
 #include <sys/param.h>
 #include "driver/uart.h"
@@ -25,10 +26,13 @@
 
 // custom include files:
 #include "uart_tcp_server.h"
+#include "uart_arbiter.h"
+#include "sensor_poll.h"
 #include "sdmmc.h"
 #include "spi.h"
 #include "file_server.h"
 #include "wifi_manager.h"
+#include "shutdown.h"
 
 static const char *TAG = "MAIN";
 
@@ -71,19 +75,78 @@ void sleep_task(void *arg)
     vTaskSuspend( NULL );
     // The task is now suspended, so will not reach here until the ISR resumes it.
 
+    // Resumed by the sleep pin, or by shutdown_request_sleep()
+    const char *reason = shutdown_requested_reason();
     printf("Detected interrup, going to sleep now !\n");
 
-    //Check if the wi-fi manager has been started. Wi-fi needs to be stopped before going to sleep.
-    if (wifi_manager_get_esp_netif_ap() != NULL) {
-        esp_wifi_stop();
-        esp_wifi_deinit();
+    shutdown_enter_sleep(reason != NULL ? reason : "sleep pin");
+    vTaskDelete(NULL);
+}
+
+//Initialize NVS partition. If full, then erease it and re-init.
+static void init_nvs(void)
+{
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+      ESP_ERROR_CHECK(nvs_flash_erase());
+      ret = nvs_flash_init();
     }
-      
-    rtc_gpio_isolate(GPIO_NUM_12);
-    esp_deep_sleep_start();
+    ESP_ERROR_CHECK(ret);
+}
+
+// Task doing the part of the start up that is not needed to receive SPI messages, on a SPI only wake up.
+// Runs at low priority so the SPI receiver and SD writer are never delayed by it.
+static void deferred_init_task(void *arg)
+{
+    int64_t start = esp_timer_get_time();
+
+    // update time. this will send a "do_get clock" command over uart 2.
+    uart_arbiter_start();
+    get_clock(3);
+    init_nvs();
+
+    ESP_LOGI(TAG, "Deferred init done in %lli ms", (esp_timer_get_time() - start) / 1000);
     vTaskDelete(NULL);
 }
 
+// Check why we woke up. Returns true if Wi-Fi and the servers should be started.
+static bool is_wifi_wakeup(void)
+{
+    // if true, enable http file server, uart-tcp server and wi-fi manager
+    bool wifi_wakeup = false;
+    
+    //get wake-up pin
+    switch (esp_sleep_get_wakeup_cause()) {
+
+        case ESP_SLEEP_WAKEUP_EXT1: {
+            uint64_t wakeup_pin_mask = esp_sleep_get_ext1_wakeup_status();
+
+            if (wakeup_pin_mask != 0) {
+                int pin = __builtin_ffsll(wakeup_pin_mask) - 1;
+                printf("Wake up from GPIO %d\n", pin);
+                if (pin == WAKEUP1) {
+                    wifi_wakeup = true;
+                }
+            } else {
+                printf("Wake up from GPIO\n");
+
+            }
+            break;
+        }
+        /*case ESP_SLEEP_WAKEUP_TOUCHPAD: {
+            printf("Wake up from touch on pad %d\n", esp_sleep_get_touchpad_wakeup_status());
+            break;
+        }*/
+        case ESP_SLEEP_WAKEUP_UNDEFINED:
+        default:
+            printf("Not a deep sleep reset\n");
+            //if (gpio_get_level(WAKEUP1) == 1) {
+                wifi_wakeup = true;
+            //}
+    }
+    return wifi_wakeup;
+}
+
 
 
 // Start mdns service. Wi-fi module can then be reached on "mdns-name.local" instead of ip adress
@@ -127,8 +190,17 @@ void app_main(void)
 
     esp_err_t ret;
     bool format = false;
+
+    // On a SPI only wake up (WAKEUP2) the master is waiting to send, so the SPI receiver is started as early as
+    // possible: the card is taken in use with the parameters saved before sleep, and the rest is done later.
+    bool wifi_wakeup = is_wifi_wakeup();
+
     // all-in-one function to mount sd card on base path "/sdcard"
-    ret = mount_sd_card(format);
+    if (wifi_wakeup) {
+        ret = mount_sd_card(format);
+    } else {
+        ret = mount_sd_card_resume();
+    }
 
     
     if (ret != ESP_OK) {
@@ -147,48 +219,14 @@ void app_main(void)
     // start a freeRtos task to wait for SPI messages. Priority should be high for this task.
     xTaskCreate(SPI_task, "SPI_receiver", 1024*5, NULL, 20, NULL);    
    
-    // update time. this will send a "do_get clock" command over uart 2.
-    get_clock(3);
-
-   //Initialize NVS partition. If full, then erease it and re-init.
-    ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-      ESP_ERROR_CHECK(nvs_flash_erase());
-      ret = nvs_flash_init();
-    }
-    ESP_ERROR_CHECK(ret);
-
-    // if true, enable http file server, uart-tcp server and wi-fi manager
-    bool wifi_wakeup = false;
-    
-    //get wake-up pin
-    switch (esp_sleep_get_wakeup_cause()) {
-
-        case ESP_SLEEP_WAKEUP_EXT1: {
-            uint64_t wakeup_pin_mask = esp_sleep_get_ext1_wakeup_status();
-
-            if (wakeup_pin_mask != 0) {
-                int pin = __builtin_ffsll(wakeup_pin_mask) - 1;
-                printf("Wake up from GPIO %d\n", pin);
-                if (pin == WAKEUP1) {
-                    wifi_wakeup = true;
-                }
-            } else {
-                printf("Wake up from GPIO\n");
-
-            }
-            break;
-        }
-        /*case ESP_SLEEP_WAKEUP_TOUCHPAD: {
-            printf("Wake up from touch on pad %d\n", esp_sleep_get_touchpad_wakeup_status());
-            break;
-        }*/
-        case ESP_SLEEP_WAKEUP_UNDEFINED:
-        default:
-            printf("Not a deep sleep reset\n");
-            //if (gpio_get_level(WAKEUP1) == 1) {
-                wifi_wakeup = true;
-            //}
+    if (wifi_wakeup) {
+        // update time. this will send a "do_get clock" command over uart 2.
+        uart_arbiter_start();
+        get_clock(3);
+        init_nvs();
+    } else {
+        // Clock and NVS are not needed to receive SPI messages
+        xTaskCreate(deferred_init_task, "deferred_init", 1024*3, NULL, 2, NULL);
     }
 
     const int ext_wakeup_pin_1 = WAKEUP1;
@@ -202,7 +240,9 @@ void app_main(void)
 
 
     // Start sleep task. Will will react to interupt on a configured pin and put device to sleep
-    xTaskCreate( sleep_task, "sleep_task", 1*1024, NULL , 4, &ISR );
+    // The shutdown runs in this task, and needs the stack for the SD writer drain, httpd_stop() and Wi-Fi deinit
+    xTaskCreate( sleep_task, "sleep_task", 4*1024, NULL , 4, &ISR );
+    shutdown_set_sleep_task(ISR);
 
     
     if (wifi_wakeup == true) {
@@ -240,11 +280,11 @@ void app_main(void)
         /* Start the mDNS service */
         start_mdns_service();
         
-        /* Start the TCP web server*/
+        /* Start the TCP to UART bridge*/
         start_tcp_server_task();
-        
-        /* Start UART RX to TCP Socet task*/
-        xTaskCreate(rx_task, "uart_rx_task", 1024*4, NULL, 10, NULL); 
+
+        /* Start polling the sensor for the web interface */
+        sensor_poll_start();
 
     }
 
@@ -0,0 +1,1177 @@
+/*  SD writer task.
+ *
+ *  Takes received SPI packets from the SPI receive task in the order they were received,
+ *  executes the commands and writes the data to the sd card. Every buffer is returned
+ *  to the SPI pool as soon as it has been written, so the SPI task can queue it again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <sys/param.h>
+#include <sys/unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "ff.h"
+
+#include "sdmmc.h"
+#include "spi.h"
+#include "spi_reader.h"
+#include "spi_capture.h"
+#include "spi_dispatch.h"
+#include "lz4_frame.h"
+#include "sd_writer.h"
+#include "shutdown.h"
+
+
+static const char *TAG = "SD_writer";
+
+/* Number of folders remembered to exist, see make_parents() */
+#define SD_DIR_CACHE_SIZE       8
+
+/* The capture file takes one of the files the SD writer can keep open */
+#ifdef CONFIG_SPI_CAPTURE
+#define SD_CAPTURE_FILES        1
+#else
+#define SD_CAPTURE_FILES        0
+#endif
+
+/* The spill file of the uart store is kept open from the first spill until it is replayed */
+#define SD_UART_STORE_FILES     1
+
+/* The uart capture writer keeps its current file open */
+#ifdef CONFIG_UART_CAPTURE
+#define SD_UART_CAPTURE_FILES   1
+#else
+#define SD_UART_CAPTURE_FILES   0
+#endif
+
+/* Files kept open by the SD writer. The rest of SD_MAX_FILES is left for the SPI reader and the http server */
+#define SD_WRITER_MAX_OPEN      (SD_MAX_FILES - 3 - SD_CAPTURE_FILES - SD_UART_STORE_FILES - SD_UART_CAPTURE_FILES)
+
+/* One stream per stream ID in the SPI header */
+typedef struct sd_stream {
+    char *path;                 // Full path of the file, NULL if no file has been opened on this stream
+    char *base;                 // Path given in OPEN_FILE when the file is rotated, path is then the current segment
+    FILE *file;                 // Open stdio handle, NULL if closed (or evicted)
+    FIL *fil;                   // Open FATFS handle when the direct path is used, NULL if closed
+    uint32_t size_hint;         // Expected file size from OPEN_FILE_EX. Preallocated streams always use the direct path
+    bool compress;              // Data is written LZ4 compressed (SPI_OPEN_COMPRESS)
+    bool make_parents;          // Missing parent folders are created when the file is opened (SPI_OPEN_MKDIR)
+    bool timestamps;            // Data is written as timestamped records (SPI_OPEN_TIMESTAMP)
+    uint64_t offset;            // File offset of the next record
+    int64_t index_time;         // Time of the last index entry, 0 if none since the file was opened
+    sd_index_entry_t *index;    // Index entries not yet written to the index file. NULL if the file has no index
+    uint8_t index_count;
+    uint8_t *zbuf;              // Data waiting to be compressed, one block. Only allocated while a compressed file is open
+    size_t zlen;                // Bytes in zbuf
+    uint32_t dirty_bytes;       // Bytes written since last sync
+    int64_t dirty_since;        // Time of the first write since last sync
+    uint32_t segment;           // Number of the current segment of a rotated file
+    uint32_t segment_bytes;     // Bytes of data written to the current segment
+    int64_t segment_start;      // Time the current segment was started
+    uint32_t last_used;         // Used to find the least recently used stream when too many files are open
+} sd_stream_t;
+
+static sd_stream_t streams[SPI_MAX_STREAMS];
+static int open_files = 0;                  // Number of streams with an open FILE
+static uint32_t use_counter = 0;
+
+static sd_stream_t *write_stream = NULL;    // Stream of the WRITEFILE command in progress
+static size_t bytes_written = 0;            // Bytes written of current WRITEFILE command
+static size_t write_length = 0;             // Total length of current WRITEFILE command
+
+/* Work area of the compressor, shared by all streams since only one block is compressed at a time */
+static uint8_t zblock[LZ4F_BLOCK_HEADER_SIZE + SPI_BLOCK_SIZE];
+static uint16_t zhash[LZ4_HASH_SIZE];
+
+/* Latest segments of rotated files, for the web interface. Written by the writer task, read by the http server */
+static sd_segment_t segments[SD_SEGMENT_EVENTS];
+static uint32_t segment_events = 0;         // Number of segments published since boot
+static SemaphoreHandle_t segments_lock = NULL;
+
+/* Shutdown request, see sd_writer_drain() */
+static TaskHandle_t writer_task = NULL;
+static atomic_bool drain_requested;
+static int64_t drain_deadline;              // Packets still waiting after this are not executed
+static SemaphoreHandle_t drain_done = NULL;
+
+/* Parent folders known to exist, replaced round robin. Files opened again under the same folder then need no
+ * stat or mkdir on the card. Cleared when an open fails, since folders can be deleted from the web interface. */
+static char *known_dirs[SD_DIR_CACHE_SIZE];
+static uint32_t known_dirs_next = 0;
+
+static sd_writer_stats_t stats;             // Throughput counters since boot
+static sd_writer_stats_t stats_logged;      // Counters at last log, to print throughput of each burst
+
+#ifdef CONFIG_SPI_WRITER_DIRECT_FATFS
+static const bool use_direct = true;
+#else
+static const bool use_direct = false;
+#endif
+
+/* Flags of a plain OPEN_FILE command */
+#ifdef CONFIG_SPI_OPEN_MKDIR
+#define OPEN_FILE_FLAGS         SPI_OPEN_MKDIR
+#else
+#define OPEN_FILE_FLAGS         0
+#endif
+
+
+static bool stream_is_open(sd_stream_t *stream)
+{
+    return stream->file != NULL || stream->fil != NULL;
+}
+
+static size_t stream_write(sd_stream_t *stream, const char *data, size_t len);
+static void stream_flush_block(sd_stream_t *stream);
+
+/* Path given in OPEN_FILE for the stream */
+static const char *stream_name(sd_stream_t *stream)
+{
+    return stream->base != NULL ? stream->base : stream->path;
+}
+
+/* Publish the state of a segment of a rotated file. The entry of the same file is updated, or the oldest replaced */
+static void publish_segment(sd_stream_t *stream, sd_segment_state_t state)
+{
+    struct stat st;
+    sd_segment_t *entry = NULL;
+
+    if (segments_lock == NULL || stream->base == NULL || stream->path == NULL) {
+        return;
+    }
+    int64_t size = (state == SD_SEGMENT_FINISHED && stat(stream->path, &st) == 0) ? st.st_size : -1;
+
+    xSemaphoreTake(segments_lock, portMAX_DELAY);
+    for (int i = 0; i < SD_SEGMENT_EVENTS && i < segment_events; i++) {
+        if (strcmp(segments[i].path, stream->path) == 0) {
+            entry = &segments[i];
+            break;
+        }
+    }
+    if (entry == NULL) {
+        entry = &segments[segment_events++ % SD_SEGMENT_EVENTS];
+        strlcpy(entry->path, stream->path, sizeof(entry->path));
+    }
+    entry->segment = stream->segment;
+    entry->state = state;
+    entry->size = size;
+    xSemaphoreGive(segments_lock);
+
+    if (state == SD_SEGMENT_FINISHED) {
+        ESP_LOGI(TAG, "Segment finished: %s (%lli bytes)", stream->path, size);
+    }
+}
+
+/* Append the collected time index entries to the index file beside the file */
+static void flush_index(sd_stream_t *stream)
+{
+    char path[SD_SEGMENT_PATH_MAX + sizeof(SD_INDEX_SUFFIX)];
+
+    if (stream->index_count == 0) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s%s", stream->path, SD_INDEX_SUFFIX);
+    FILE *fd = fopen(path, "ab");
+    if (fd == NULL || fwrite(stream->index, sizeof(sd_index_entry_t), stream->index_count, fd) != stream->index_count) {
+        printf("Cannot write time index %s\n", path);
+    }
+    if (fd != NULL) {
+        fclose(fd);
+    }
+    stream->index_count = 0;
+}
+
+static void close_stream(sd_stream_t *stream)
+{
+    stream->dirty_bytes = 0;
+
+    // Finish the LZ4 frame. zbuf is allocated when the frame is started
+    if (stream->zbuf != NULL && stream_is_open(stream)) {
+        uint8_t end_mark[LZ4F_END_MARK_SIZE];
+        stream_flush_block(stream);
+        stream_write(stream, (char *)end_mark, lz4f_end_mark(end_mark));
+    }
+    free(stream->zbuf);
+    stream->zbuf = NULL;
+    stream->zlen = 0;
+
+    flush_index(stream);
+    free(stream->index);
+    stream->index = NULL;
+    stream->index_time = 0;
+
+    // Give back the preallocated clusters that were not written
+    if (stream->fil != NULL && stream->size_hint > 0 && f_tell(stream->fil) < f_size(stream->fil)) {
+        if (f_truncate(stream->fil) != FR_OK) {
+            printf("Failed to trim preallocated file %s\n", stream->path);
+        }
+    }
+    if (stream->file != NULL) {
+        fclose(stream->file);
+        stream->file = NULL;
+        open_files--;
+    }
+    if (stream->fil != NULL) {
+        f_close(stream->fil);
+        free(stream->fil);
+        stream->fil = NULL;
+        open_files--;
+    }
+}
+
+static void close_all_streams(void)
+{
+    for (int i = 0; i < SPI_MAX_STREAMS; i++) {
+        if (stream_is_open(&streams[i])) {
+            close_stream(&streams[i]);
+            ESP_LOGI(TAG, "file closed: %s\n", streams[i].path);
+        }
+    }
+}
+
+/* Close the least recently used open file to make room for a new one */
+static void evict_stream(void)
+{
+    sd_stream_t *lru = NULL;
+
+    for (int i = 0; i < SPI_MAX_STREAMS; i++) {
+        if (stream_is_open(&streams[i]) && (lru == NULL || (int32_t)(streams[i].last_used - lru->last_used) < 0)) {
+            lru = &streams[i];
+        }
+    }
+    if (lru != NULL) {
+        printf("Too many open files, closing %s\n", lru->path);
+        close_stream(lru);
+    }
+}
+
+/* Allocate clusters for the file up to the size hint, so the FAT chain does not have to be extended while writing.
+ * The file pointer is left at the end of the existing data. */
+static void preallocate(sd_stream_t *stream)
+{
+    FSIZE_t data_end = f_tell(stream->fil);
+    FRESULT res;
+    int64_t start = esp_timer_get_time();
+
+#if FF_USE_EXPAND
+    // An empty file can get one contiguous block of clusters
+    if (f_size(stream->fil) == 0) {
+        res = f_expand(stream->fil, stream->size_hint, 1);
+        if (res == FR_OK) {
+            printf("Preallocated %u contiguous bytes for %s in %lli us\n", stream->size_hint, stream->path, esp_timer_get_time() - start);
+            return;
+        }
+    }
+#endif
+    // Seeking past the end of a file open for writing extends the cluster chain up to the new size.
+    // FATFS takes the free clusters following the last allocated one, so they are contiguous on a card with free space.
+    res = f_lseek(stream->fil, stream->size_hint);
+    if (res == FR_OK && f_tell(stream->fil) == stream->size_hint) {
+        printf("Preallocated %u bytes for %s in %lli us\n", stream->size_hint, stream->path, esp_timer_get_time() - start);
+    } else {
+        printf("Could not preallocate %u bytes for %s (%d)\n", stream->size_hint, stream->path, res);
+    }
+    f_lseek(stream->fil, data_end);
+}
+
+/* Sync a preallocated file with its directory entry at the end of the data, not at the size hint. The clusters
+ * after the data stay in the chain and are used by the next writes, also after a reopen. A file cut short by a power
+ * loss then ends at the last synced data, instead of at the hint with an unwritten tail that appends would follow. */
+static FRESULT sync_data_end(FIL *fil)
+{
+    FSIZE_t alloc_end = f_size(fil);
+    fil->obj.objsize = f_tell(fil);
+    FRESULT res = f_sync(fil);
+    fil->obj.objsize = alloc_end;
+    return res;
+}
+
+/* Open the file of a stream directly on FATFS, bypassing newlib stdio and VFS */
+static bool stream_open_direct(sd_stream_t *stream)
+{
+    char fat_path[FILE_PATH_MAX];
+
+    if (!get_fat_path(fat_path, stream->path, sizeof(fat_path))) {
+        printf("Cannot open file %s, sd card not mounted\n", stream->path);
+        return false;
+    }
+
+    stream->fil = (FIL*)calloc(1, sizeof(FIL));
+    if (stream->fil == NULL) {
+        printf("Cannot allocate FIL for %s\n", stream->path);
+        return false;
+    }
+
+    FRESULT res = f_open(stream->fil, fat_path, FA_WRITE | FA_OPEN_APPEND);
+    if (res != FR_OK) {
+        printf("Cannot open file %s (%d)\n", stream->path, res);
+        free(stream->fil);
+        stream->fil = NULL;
+        return false;
+    }
+
+    if (stream->size_hint > f_size(stream->fil)) {
+        preallocate(stream);
+    }
+    return true;
+}
+
+/* Each time a compressed file is opened a new LZ4 frame is started. Frames are simply appended,
+ * readers decompress them one after another. */
+static bool stream_start_frame(sd_stream_t *stream)
+{
+    uint8_t header[LZ4F_HEADER_SIZE];
+
+    stream->zbuf = (uint8_t *)malloc(SPI_BLOCK_SIZE);
+    if (stream->zbuf == NULL) {
+        printf("Cannot allocate compression buffer for %s\n", stream->path);
+        close_stream(stream);
+        return false;
+    }
+    stream->zlen = 0;
+    stream_write(stream, (char *)header, lz4f_frame_header(header));
+    return true;
+}
+
+static bool stream_open_file(sd_stream_t *stream)
+{
+    if (use_direct || stream->size_hint > 0) {
+        return stream_open_direct(stream);
+    }
+
+    //ab = Opens a file for appending in binary mode. If not exist, then create file.
+    stream->file = fopen(stream->path, "ab");
+    if (stream->file == NULL) {
+        printf("Cannot open file %s\n", stream->path);
+        return false;
+    }
+
+    /* Increase internal write buffer from 128 bytes to the blocksize we use. Needs to be run per file we open */
+    setvbuf(stream->file, NULL, _IOFBF, SPI_BLOCK_SIZE);
+    return true;
+}
+
+static bool dir_is_known(const char *dir, size_t len)
+{
+    for (int i = 0; i < SD_DIR_CACHE_SIZE; i++) {
+        if (known_dirs[i] != NULL && strncmp(known_dirs[i], dir, len) == 0 && known_dirs[i][len] == '\0') {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void remember_dir(const char *dir, size_t len)
+{
+    char *copy = strndup(dir, len);
+    if (copy == NULL) {
+        return;
+    }
+    uint32_t i = known_dirs_next++ % SD_DIR_CACHE_SIZE;
+    free(known_dirs[i]);
+    known_dirs[i] = copy;
+}
+
+static void forget_dirs(void)
+{
+    for (int i = 0; i < SD_DIR_CACHE_SIZE; i++) {
+        free(known_dirs[i]);
+        known_dirs[i] = NULL;
+    }
+}
+
+/* Create the missing parent folders of a file, like mkdir -p. Returns false if a folder could not be created */
+static bool make_parents(const char *path)
+{
+    const size_t sd_mount_len = sizeof(BASE_PATH) - 1;
+    char dir[FILE_PATH_MAX + sizeof(BASE_PATH)];
+    struct stat st;
+
+    const char *name = strrchr(path + sd_mount_len, '/');
+    if (name == NULL) {
+        return true;            // File in the root folder
+    }
+    size_t len = name - path;
+    if (dir_is_known(path, len)) {
+        return true;
+    }
+    if (len >= sizeof(dir)) {
+        return false;
+    }
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+
+    // Usually only the last folder is new, or none when the cache was cleared. Walk from the top otherwise.
+    if (stat(dir, &st) != 0) {
+        for (char *p = dir + sd_mount_len; ; p++) {
+            if (*p != '/' && *p != '\0') {
+                continue;
+            }
+            char c = *p;
+            // Empty names ("a//b") are skipped. The root folder always exists.
+            if (p[-1] != '/') {
+                *p = '\0';
+                if (stat(dir, &st) != 0) {
+                    if (mkdir(dir, S_IRWXU) != 0) {
+                        printf("Cannot create directory %s\n", dir);
+                        return false;
+                    }
+                    printf("Directory created: %s\n", dir);
+                }
+                *p = c;
+            }
+            if (c == '\0') {
+                break;
+            }
+        }
+    }
+    remember_dir(dir, len);
+    return true;
+}
+
+/* Records are appended, so the index continues at the end of the file. A compressed file has no index,
+ * offsets in it can not be seeked to. */
+static void stream_start_index(sd_stream_t *stream)
+{
+    struct stat st;
+
+    if (stream->fil != NULL) {
+        stream->offset = f_tell(stream->fil);
+    } else {
+        stream->offset = stat(stream->path, &st) == 0 ? st.st_size : 0;
+    }
+    if (!stream->compress) {
+        stream->index = (sd_index_entry_t *)malloc(SD_INDEX_BUFFER * sizeof(sd_index_entry_t));
+        if (stream->index == NULL) {
+            printf("Cannot allocate time index for %s\n", stream->path);
+        }
+    }
+}
+
+/* Make sure the file of a stream is open. Reopens the file if it was closed by idle timeout or eviction. */
+static bool stream_open(sd_stream_t *stream)
+{
+    stream->last_used = ++use_counter;
+
+    if (stream_is_open(stream)) {
+        return true;
+    }
+    if (stream->path == NULL) {
+        return false;
+    }
+
+    if (open_files >= SD_WRITER_MAX_OPEN) {
+        evict_stream();
+    }
+
+    if (stream->make_parents) {
+        make_parents(stream->path);
+    }
+    bool opened = stream_open_file(stream);
+    if (!opened && stream->make_parents) {
+        // The folder may have been deleted since it was cached. Look it up on the card again.
+        forget_dirs();
+        opened = make_parents(stream->path) && stream_open_file(stream);
+    }
+    if (!opened) {
+        return false;
+    }
+    open_files++;
+
+    if (stream->compress && !stream_start_frame(stream)) {
+        return false;
+    }
+    if (stream->timestamps) {
+        stream_start_index(stream);
+    }
+    publish_segment(stream, SD_SEGMENT_WRITING);
+    return true;
+}
+
+/* Path of segment n of a rotated file: "name.0001", or "name.0001.lz4" for compressed files named *.lz4
+ * so they are still recognized as compressed. Returns a malloc'ed path, NULL if out of memory */
+static char *segment_path(const char *base, bool compress, uint32_t segment)
+{
+    size_t len = strlen(base);
+    const char *ext = "";
+    char *path = (char *)malloc(len + 16);
+
+    if (path == NULL) {
+        return NULL;
+    }
+    if (compress && len > 4 && strcasecmp(base + len - 4, ".lz4") == 0) {
+        ext = ".lz4";
+        len -= 4;
+    }
+    sprintf(path, "%.*s.%04u%s", (int)len, base, segment, ext);
+    return path;
+}
+
+/* Highest segment number of a rotated file already on the card, 0 if none */
+static uint32_t last_segment(const char *base, bool compress)
+{
+    uint32_t last = 0;
+    const char *name = strrchr(base, '/') + 1;
+    size_t name_len = strlen(name);
+    const char *ext = "";
+
+    if (compress && name_len > 4 && strcasecmp(name + name_len - 4, ".lz4") == 0) {
+        ext = ".lz4";
+        name_len -= 4;
+    }
+
+    char *dir_path = strndup(base, name - base);
+    DIR *dir = dir_path != NULL ? opendir(dir_path) : NULL;
+    free(dir_path);
+    if (dir == NULL) {
+        return 0;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, name, name_len) != 0 || entry->d_name[name_len] != '.') {
+            continue;
+        }
+        char *end;
+        uint32_t n = strtoul(entry->d_name + name_len + 1, &end, 10);
+        if (end != entry->d_name + name_len + 1 && strcasecmp(end, ext) == 0) {
+            last = MAX(last, n);
+        }
+    }
+    closedir(dir);
+    return last;
+}
+
+/* Move a rotated stream to its next segment. The file is opened on the next write */
+static void next_segment(sd_stream_t *stream)
+{
+    free(stream->path);
+    stream->segment++;
+    stream->path = segment_path(stream->base, stream->compress, stream->segment);
+    stream->segment_bytes = 0;
+    stream->segment_start = esp_timer_get_time();
+    if (stream->path == NULL) {
+        printf("Cannot allocate path of segment %u of %s\n", stream->segment, stream->base);
+    }
+}
+
+/* Rotation policy. A segment is finished after SD_ROTATE_BYTES of data or SD_ROTATE_SECONDS */
+static bool segment_full(sd_stream_t *stream)
+{
+    return (SD_ROTATE_BYTES > 0 && stream->segment_bytes >= SD_ROTATE_BYTES) ||
+           (SD_ROTATE_SECONDS > 0 && esp_timer_get_time() - stream->segment_start >= SD_ROTATE_SECONDS * 1000000LL);
+}
+
+/* Finish the current segment and open the next one. Runs in the writer task, the SPI task keeps
+ * receiving into free buffers while the old segment is closed. */
+static void rotate_stream(sd_stream_t *stream)
+{
+    close_stream(stream);
+    publish_segment(stream, SD_SEGMENT_FINISHED);
+    next_segment(stream);
+    stream_open(stream);
+}
+
+/* Write to the file of a stream. Returns number of bytes written */
+static size_t stream_write(sd_stream_t *stream, const char *data, size_t len)
+{
+    size_t written = 0;
+    int64_t start = esp_timer_get_time();
+
+    if (stream->fil != NULL) {
+        /* Data comes straight from the word alligned DMA buffer. When the file pointer is on a sector boundary
+         * FATFS writes all whole sectors directly from this buffer to the card in one multi-sector transfer,
+         * only a partial sector at the end goes through the FIL sector buffer. */
+        UINT bw = 0;
+        if (f_write(stream->fil, data, len, &bw) != FR_OK) {
+            printf("Write failed: %s\n", stream->path);
+        }
+        written = bw;
+    } else if (stream->file != NULL) {
+        written = fwrite(data, 1, len, stream->file);
+    }
+
+    stats.write_us += esp_timer_get_time() - start;
+    stats.bytes += written;
+    stats.writes++;
+    return written;
+}
+
+/* Compress the buffered data of a compressed stream to one block and write it */
+static void stream_flush_block(sd_stream_t *stream)
+{
+    if (stream->zlen == 0) {
+        return;
+    }
+    size_t len = lz4f_compress_block(stream->zbuf, stream->zlen, zblock, zhash);
+    stream_write(stream, (char *)zblock, len);
+    stream->zlen = 0;
+}
+
+/* Write data of a WRITEFILE command to a stream. Compressed streams collect the data in whole blocks first.
+ * Returns number of bytes taken */
+static size_t stream_put(sd_stream_t *stream, const char *data, size_t len)
+{
+    stats.input_bytes += len;
+
+    if (!stream->compress) {
+        return stream_write(stream, data, len);
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        // Whole blocks are compressed straight from the SPI buffer
+        if (stream->zlen == 0 && len - done >= SPI_BLOCK_SIZE) {
+            size_t zsize = lz4f_compress_block((const uint8_t *)data + done, SPI_BLOCK_SIZE, zblock, zhash);
+            stream_write(stream, (char *)zblock, zsize);
+            done += SPI_BLOCK_SIZE;
+            continue;
+        }
+        size_t n = MIN(len - done, SPI_BLOCK_SIZE - stream->zlen);
+        memcpy(stream->zbuf + stream->zlen, data + done, n);
+        stream->zlen += n;
+        done += n;
+        if (stream->zlen == SPI_BLOCK_SIZE) {
+            stream_flush_block(stream);
+        }
+    }
+    return done;
+}
+
+static void stream_sync(sd_stream_t *stream)
+{
+    int64_t start = esp_timer_get_time();
+
+    if (stream->compress) {
+        stream_flush_block(stream);
+    }
+    if (stream->fil != NULL && stream->size_hint > 0) {
+        sync_data_end(stream->fil);
+    } else if (stream->fil != NULL) {
+        f_sync(stream->fil);
+    } else if (stream->file != NULL) {
+        fflush(stream->file);
+        fsync(fileno(stream->file));
+    }
+    stream->dirty_bytes = 0;
+
+    int64_t time = esp_timer_get_time() - start;
+    stats.syncs++;
+    stats.sync_us += time;
+    stats.sync_max_us = MAX(stats.sync_max_us, time);
+}
+
+/* Group commit. Sync the streams that have SD_SYNC_BYTES unsynced bytes, or unsynced data older than
+ * SD_SYNC_INTERVAL_MS. Runs in the writer task between packets, the SPI task keeps receiving into free buffers
+ * meanwhile. Returns time in ms until the next sync is due, or max_wait_ms if that is sooner. */
+static uint32_t sync_due_streams(uint32_t max_wait_ms)
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t wait_ms = max_wait_ms;
+
+    for (int i = 0; i < SPI_MAX_STREAMS; i++) {
+        sd_stream_t *stream = &streams[i];
+        if (stream->dirty_bytes == 0 || !stream_is_open(stream)) {
+            continue;
+        }
+        int64_t age_ms = (now - stream->dirty_since) / 1000;
+        if ((SD_SYNC_BYTES > 0 && stream->dirty_bytes >= SD_SYNC_BYTES) ||
+            (SD_SYNC_INTERVAL_MS > 0 && age_ms >= SD_SYNC_INTERVAL_MS)) {
+            stream_sync(stream);
+        } else if (SD_SYNC_INTERVAL_MS > 0) {
+            wait_ms = MIN(wait_ms, SD_SYNC_INTERVAL_MS - age_ms);
+        }
+    }
+    return wait_ms;
+}
+
+/* System time of a receive time since boot. The clock is set by get_clock() */
+static int64_t wall_time(int64_t time)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_usec - (esp_timer_get_time() - time);
+}
+
+/* Write the data of one packet as a record with its receive time. A record is kept in one segment of a rotated file,
+ * so a new segment is started before a record that would go past SD_ROTATE_BYTES. */
+static void write_record(sd_stream_t *stream, const char *data, size_t len, int64_t time)
+{
+    sd_record_header_t header = {
+        .magic = SD_RECORD_MAGIC,
+        .len = len,
+        .time = wall_time(time),
+    };
+    size_t size = sizeof(header) + len;
+
+    if (stream->base != NULL && (segment_full(stream) ||
+        (SD_ROTATE_BYTES > 0 && stream->segment_bytes > 0 && stream->segment_bytes + size > SD_ROTATE_BYTES))) {
+        rotate_stream(stream);
+        if (!stream_is_open(stream)) {
+            return;
+        }
+    }
+
+    if (stream->index != NULL && (stream->index_time == 0 || header.time - stream->index_time >= SD_INDEX_INTERVAL_MS * 1000LL)) {
+        if (stream->index_count == SD_INDEX_BUFFER) {
+            flush_index(stream);
+        }
+        stream->index[stream->index_count].time = header.time;
+        stream->index[stream->index_count].offset = stream->offset;
+        stream->index_count++;
+        stream->index_time = header.time;
+    }
+
+    if (stream->dirty_bytes == 0) {
+        stream->dirty_since = esp_timer_get_time();
+    }
+    stream->dirty_bytes += size;
+    stream->segment_bytes += size;
+    stream->offset += size;
+    stream_put(stream, (const char *)&header, sizeof(header));
+    bytes_written += stream_put(stream, data, len);
+}
+
+static void write_data(const char *data, size_t len, int64_t time)
+{
+    if (write_stream == NULL || !stream_open(write_stream)) {
+        return;
+    }
+    if (write_stream->timestamps) {
+        if (len > 0) {
+            write_record(write_stream, data, len, time);
+        }
+        return;
+    }
+    while (len > 0) {
+        size_t n = len;
+
+        // Rotated files are split exactly at SD_ROTATE_BYTES
+        if (write_stream->base != NULL) {
+            if (segment_full(write_stream)) {
+                rotate_stream(write_stream);
+                if (!stream_is_open(write_stream)) {
+                    return;
+                }
+            }
+            if (SD_ROTATE_BYTES > 0) {
+                n = MIN(n, SD_ROTATE_BYTES - write_stream->segment_bytes);
+            }
+            write_stream->segment_bytes += n;
+        }
+
+        /* Write received data to sd card */
+        if (write_stream->dirty_bytes == 0) {
+            write_stream->dirty_since = esp_timer_get_time();
+        }
+        write_stream->dirty_bytes += n;
+        bytes_written += stream_put(write_stream, data, n);
+        data += n;
+        len -= n;
+    }
+}
+
+static void write_done(void)
+{
+    printf("WRITE COMMAND Received:   Received bytes vs written bytes: %i bytes vs %i bytes \n", write_length, bytes_written);
+}
+
+static void open_file(sd_stream_t *stream, const char *spi_data, uint16_t length, uint32_t size_hint, uint8_t flags)
+{
+    const size_t sd_mount_len = sizeof(BASE_PATH) - 1;         //Length of sd card base folder
+
+    if (length > FILE_PATH_MAX - sd_mount_len - 1) {
+        printf("Path length cannot be longer than %i characters,  Received: %i\n", FILE_PATH_MAX - sd_mount_len - 1, length);
+        return;
+    }
+
+    bool compress = (flags & SPI_OPEN_COMPRESS) != 0;
+    bool rotate = (flags & SPI_OPEN_ROTATE) != 0;
+    bool timestamps = (flags & SPI_OPEN_TIMESTAMP) != 0;
+    const char *name = stream_name(stream);
+    // The path ends at a null byte inside the header length, as it does when it is copied below
+    length = strnlen(spi_data, length);
+
+    // Check if the same file is already open on this stream. If so, we save a couple of milli seconds.
+    if (name == NULL || strlen(name) != sd_mount_len + length || strncmp(name + sd_mount_len, spi_data, length) != 0 ||
+        (stream->base != NULL) != rotate || stream->compress != compress || stream->timestamps != timestamps)
+    {
+        /* If another file is open on this stream, close it */
+        if (stream_is_open(stream)) {
+            close_stream(stream);
+            publish_segment(stream, SD_SEGMENT_FINISHED);
+            printf("Open file closed\n");
+        }
+        free(stream->path);
+        free(stream->base);
+        stream->base = NULL;
+        stream->path = (char*)malloc(sd_mount_len + length + 1);
+        if (stream->path == NULL) {
+            printf("Cannot allocate path\n");
+            return;
+        }
+        strcpy(stream->path, BASE_PATH);
+        strncat(stream->path, spi_data, length);
+
+        // Only one handle per file, otherwise buffered data of the two handles would be mixed up
+        for (int i = 0; i < SPI_MAX_STREAMS; i++) {
+            if (&streams[i] != stream && stream_name(&streams[i]) != NULL && strcmp(stream_name(&streams[i]), stream->path) == 0) {
+                printf("File %s already open on stream %i, closing it there\n", stream->path, i);
+                close_stream(&streams[i]);
+                free(streams[i].path);
+                free(streams[i].base);
+                streams[i].path = NULL;
+                streams[i].base = NULL;
+            }
+        }
+
+        // A rotated file continues after the last segment on the card
+        stream->compress = compress;
+        stream->timestamps = timestamps;
+        if (rotate) {
+            stream->base = stream->path;
+            stream->path = NULL;
+            stream->segment = last_segment(stream->base, compress);
+            next_segment(stream);
+        }
+    }
+
+    stream->make_parents = (flags & SPI_OPEN_MKDIR) != 0;
+
+    // A new size hint takes effect when the file is opened. Reopen if it changed.
+    if (stream->size_hint != size_hint) {
+        close_stream(stream);
+        stream->size_hint = size_hint;
+    }
+
+    stream_open(stream);
+
+    printf("\nOPEN FILE COMMAND Received: Stream: %i  |  Length: %i bytes  |  filename: %s\n", (int)(stream - streams), length, stream->path);
+}
+
+static void read_open(const char *spi_data, uint16_t length)
+{
+    char path[FILE_PATH_MAX + sizeof(BASE_PATH)];
+
+    if (length > FILE_PATH_MAX) {
+        printf("READ OPEN COMMAND: Path length cannot be longer than %i characters\n", FILE_PATH_MAX);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s%.*s", BASE_PATH, length, spi_data);
+    spi_reader_open(path);
+}
+
+static void make_dir(const char *spi_data, uint16_t length)
+{
+    const size_t sd_mount_len = sizeof(BASE_PATH) - 1;
+
+    if (length > FILE_PATH_MAX) {
+        printf("Path length cannot be longer than 255 characters");
+        return;
+    }
+
+    char * folder_path = (char*)malloc(length + sd_mount_len + 1);         // Allocate memmory for path + extra byte for '/' and a terminating 0 byte.
+    strcpy(folder_path, BASE_PATH);
+    strncat(folder_path, spi_data, length);
+
+    if (mkdir(folder_path, S_IRWXU ) == 0) {    // S_IRWXU = chmod 777
+        printf("MAKEDIR COMMAND: Directory created: %s\n", folder_path);
+        remember_dir(folder_path, strlen(folder_path));
+    } else {
+        printf("MAKEDIR COMMAND: Directory already exists or could not be created: %s\n", folder_path);
+    }
+    free(folder_path);
+}
+
+void sd_writer_get_stats(sd_writer_stats_t *out)
+{
+    *out = stats;
+}
+
+size_t sd_writer_get_segments(sd_segment_t *out, size_t max)
+{
+    size_t count = 0;
+
+    if (segments_lock == NULL) {
+        return 0;
+    }
+    xSemaphoreTake(segments_lock, portMAX_DELAY);
+    // Newest first
+    for (uint32_t i = segment_events; i > 0 && count < max && segment_events - i < SD_SEGMENT_EVENTS; i--) {
+        out[count++] = segments[(i - 1) % SD_SEGMENT_EVENTS];
+    }
+    xSemaphoreGive(segments_lock);
+    return count;
+}
+
+bool sd_writer_is_writing(const char *path)
+{
+    bool writing = false;
+
+    if (segments_lock == NULL) {
+        return false;
+    }
+    xSemaphoreTake(segments_lock, portMAX_DELAY);
+    for (int i = 0; i < SD_SEGMENT_EVENTS && i < segment_events; i++) {
+        if (segments[i].state == SD_SEGMENT_WRITING && strcmp(segments[i].path, path) == 0) {
+            writing = true;
+            break;
+        }
+    }
+    xSemaphoreGive(segments_lock);
+    return writing;
+}
+
+/* Print write throughput since last time, so the stdio and direct FATFS path can be compared */
+static void log_throughput(void)
+{
+    uint64_t bytes = stats.bytes - stats_logged.bytes;
+    int64_t write_us = stats.write_us - stats_logged.write_us;
+
+    if (bytes == 0 || write_us <= 0) {
+        return;
+    }
+    printf("SD write: %llu bytes in %5.3f s, %5.2f MB/s (%s)\n", bytes, write_us / 1e6f,
+            (float)bytes / (write_us / 1e6f) / (1024 * 1024), use_direct ? "direct FATFS" : "stdio");
+    uint32_t syncs = stats.syncs - stats_logged.syncs;
+    if (syncs > 0) {
+        printf("SD sync: %u syncs, average %lli us, max %lli us since boot\n", syncs,
+                (stats.sync_us - stats_logged.sync_us) / syncs, stats.sync_max_us);
+    }
+    uint64_t input_bytes = stats.input_bytes - stats_logged.input_bytes;
+    if (input_bytes != bytes) {
+        printf("SD write: %llu bytes received, compressed to %3.1f %%\n", input_bytes, 100.0f * bytes / input_bytes);
+    }
+    stats_logged = stats;
+}
+
+// Replace all '\' with '/' in a path that is not null terminated
+static void fix_path(char *spi_path, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        if (spi_path[i] == '\\') {
+            spi_path[i] = '/';
+        }
+    }
+}
+
+/* Command handlers, see spi_dispatch.h. The stream ID is checked by the dispatcher. */
+
+/* WRITEFILE. Called for each part of the data, a write longer than SPI_BLOCK_SIZE continues in following packets */
+static void cmd_write(const spi_command_t *cmd)
+{
+    if (cmd->offset == 0) {
+        write_stream = &streams[cmd->stream_id];
+        write_length = cmd->length;
+        bytes_written = 0;
+        if (write_stream->path == NULL) {
+            printf("Cannot write, no file opened on stream %i\n", cmd->stream_id);
+        }
+    }
+    write_data(cmd->data, cmd->len, cmd->time);
+    if (cmd->offset + cmd->len == cmd->length) {
+        write_done();
+    }
+}
+
+static void cmd_open_file(const spi_command_t *cmd)
+{
+    if (cmd->length <= FILE_PATH_MAX) {
+        fix_path(cmd->data, cmd->length);
+    }
+    open_file(&streams[cmd->stream_id], cmd->data, cmd->length, 0, OPEN_FILE_FLAGS);
+}
+
+static void cmd_open_file_ex(const spi_command_t *cmd)
+{
+    spi_open_ex_t options;
+
+    if (cmd->length <= sizeof(spi_open_ex_t) || cmd->length > sizeof(spi_open_ex_t) + FILE_PATH_MAX) {
+        printf("OPEN FILE EX COMMAND: Invalid length: %i\n", cmd->length);
+        return;
+    }
+    memcpy(&options, cmd->data, sizeof(options));
+    char *path = cmd->data + sizeof(spi_open_ex_t);
+    uint16_t length = cmd->length - sizeof(spi_open_ex_t);
+
+    fix_path(path, length);
+    open_file(&streams[cmd->stream_id], path, length, options.size_hint, options.flags);
+}
+
+static void cmd_make_dir(const spi_command_t *cmd)
+{
+    make_dir(cmd->data, cmd->length);
+}
+
+static void cmd_close_file(const spi_command_t *cmd)
+{
+    sd_stream_t *stream = &streams[cmd->stream_id];
+
+    if (stream_is_open(stream)) {
+        close_stream(stream);
+        publish_segment(stream, SD_SEGMENT_FINISHED);
+        printf("FILE CLOSE COMMAND: %s !\n", stream->path);
+    }
+}
+
+static void cmd_sync_file(const spi_command_t *cmd)
+{
+    sd_stream_t *stream = &streams[cmd->stream_id];
+
+    if (stream_is_open(stream)) {
+        stream_sync(stream);
+        printf("FILE SYNC COMMAND: %s !\n", stream->path);
+    }
+}
+
+static void cmd_set_queue_depth(const spi_command_t *cmd)
+{
+    if (cmd->length < 1 || !spi_set_queue_depth(cmd->data[0])) {
+        printf("SET QUEUE DEPTH COMMAND: Invalid depth\n");
+    } else {
+        printf("SET QUEUE DEPTH COMMAND: %i\n", cmd->data[0]);
+    }
+}
+
+static void cmd_read_open(const spi_command_t *cmd)
+{
+    if (cmd->length <= FILE_PATH_MAX) {
+        fix_path(cmd->data, cmd->length);
+    }
+    read_open(cmd->data, cmd->length);
+}
+
+static void cmd_read_block(const spi_command_t *cmd)
+{
+    // Only clocks out read data, unless an offset to continue from is given
+    if (cmd->length >= sizeof(uint32_t)) {
+        uint32_t offset;
+        memcpy(&offset, cmd->data, sizeof(offset));
+        spi_reader_seek(offset);
+    }
+}
+
+static void cmd_sleep(const spi_command_t *cmd)
+{
+    shutdown_enter_sleep("SLEEP command");
+}
+
+static void register_commands(void)
+{
+    spi_register_command(WRITEFILE, cmd_write, SPI_CMD_FOLLOW_ON);
+    spi_register_command(OPEN_FILE, cmd_open_file, 0);
+    spi_register_command(OPEN_FILE_EX, cmd_open_file_ex, 0);
+    spi_register_command(MAKEDIR, cmd_make_dir, 0);
+    spi_register_command(CLOSE_FILE, cmd_close_file, 0);
+    spi_register_command(SYNCFILE, cmd_sync_file, 0);
+    spi_register_command(SET_QUEUE_DEPTH, cmd_set_queue_depth, 0);
+    spi_register_command(READ_OPEN, cmd_read_open, 0);
+    spi_register_command(READ_BLOCK, cmd_read_block, 0);
+    spi_register_command(SLEEP, cmd_sleep, 0);
+}
+
+/* Finish what was received before going to sleep: close the files of commands cut short, sync and close all files */
+static void finish_writing(void)
+{
+    if (spi_dispatch_reset() > 0) {
+        write_done();
+    }
+    close_all_streams();
+#ifdef CONFIG_SPI_CAPTURE
+    spi_capture_close();
+#endif
+    log_throughput();
+}
+
+bool sd_writer_drain(uint32_t timeout_ms)
+{
+    if (writer_task == NULL) {
+        return true;
+    }
+    // SLEEP command, the packets before it are already executed
+    if (xTaskGetCurrentTaskHandle() == writer_task) {
+        finish_writing();
+        return true;
+    }
+    // Half the time for the packets waiting, the rest for closing the files
+    drain_deadline = esp_timer_get_time() + timeout_ms * 500LL;
+    atomic_store(&drain_requested, true);
+    xTaskNotifyGive(writer_task);
+    return xSemaphoreTake(drain_done, pdMS_TO_TICKS(timeout_ms)) == pdTRUE;
+}
+
+void sd_writer_task(void *arg)
+{
+    spi_buffer_t *buf;
+    int64_t last_packet = esp_timer_get_time();
+
+    segments_lock = xSemaphoreCreateMutex();
+    drain_done = xSemaphoreCreateBinary();
+    writer_task = xTaskGetCurrentTaskHandle();
+    register_commands();
+
+    ESP_LOGI(TAG, "SD writer started");
+
+    while (1) {
+        // Wait for the next packet, but not past the next group commit or the idle timeout
+        int64_t idle_ms = (esp_timer_get_time() - last_packet) / 1000;
+        uint32_t wait_ms = sync_due_streams(MAX(0, SD_WRITER_IDLE_TIMEOUT_MS - idle_ms));
+        bool drain = atomic_load(&drain_requested);
+        buf = spi_get_received(drain ? 0 : (wait_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+
+        if (drain && (buf == NULL || esp_timer_get_time() > drain_deadline)) {
+            if (buf != NULL) {
+                printf("Going to sleep with SPI packets not written\n");
+                spi_release_buffer(buf);
+            }
+            finish_writing();
+            xSemaphoreGive(drain_done);
+            // Deep sleep follows. No more files are opened.
+            vTaskSuspend(NULL);
+        }
+        if (buf != NULL) {
+#ifdef CONFIG_SPI_CAPTURE
+            spi_capture_packet(buf);
+#endif
+            spi_dispatch_packet(buf);
+            // We are done with this buffer, so we can return it to the pool:
+            spi_release_buffer(buf);
+            last_packet = esp_timer_get_time();
+            continue;
+        }
+        if (esp_timer_get_time() - last_packet < SD_WRITER_IDLE_TIMEOUT_MS * 1000LL) {
+            continue;       // Woke up for a group commit
+        }
+        last_packet = esp_timer_get_time();
+
+        // No SPI messages for a while.
+        size_t missing = spi_dispatch_reset();
+        if (missing > 0) {
+            printf("Could not receive message! No messages received since last time! %i bytes missing\n", missing);
+            write_done();
+        }
+
+        // Close open files. Open file is not allowed to be downloaded through the web interface.
+        close_all_streams();
+#ifdef CONFIG_SPI_CAPTURE
+        spi_capture_close();
+#endif
+        log_throughput();
+        spi_dispatch_log_stats();
+    }
+
+    vTaskDelete(NULL);
+}
@@ -0,0 +1,101 @@
+#pragma once
+#ifndef SD_WRITER_H_INCLUDED
+#define SD_WRITER_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Time without SPI messages before an open file is closed. Open files can not be downloaded through the web interface */
+#define SD_WRITER_IDLE_TIMEOUT_MS   1000
+
+/* Group commit policy. A file is synced when either limit is reached, 0 disables the limit */
+#define SD_SYNC_BYTES               CONFIG_SPI_SYNC_BYTES
+#define SD_SYNC_INTERVAL_MS         CONFIG_SPI_SYNC_INTERVAL_MS
+
+/* Rotation policy for files opened with SPI_OPEN_ROTATE. A new segment is started when either limit is reached,
+ * 0 disables the limit */
+#define SD_ROTATE_BYTES             CONFIG_SPI_ROTATE_BYTES
+#define SD_ROTATE_SECONDS           CONFIG_SPI_ROTATE_SECONDS
+
+/* Time index of files opened with SPI_OPEN_TIMESTAMP. An entry is added when a record is this much newer than the
+ * last entry. Entries are collected in RAM and appended to the index file SD_INDEX_BUFFER at a time, and on close */
+#define SD_INDEX_INTERVAL_MS        1000
+#define SD_INDEX_BUFFER             32
+#define SD_INDEX_SUFFIX             ".idx"
+
+/* Number of latest segments of rotated files that are published */
+#define SD_SEGMENT_EVENTS           8
+#define SD_SEGMENT_PATH_MAX         272
+
+
+/* Write counters. Time is spent inside write calls, so bytes / write_us is the throughput of the write path */
+typedef struct sd_writer_stats {
+    uint64_t bytes;             /* Bytes written to files */
+    uint64_t input_bytes;       /* Bytes received for files. More than bytes when files are compressed */
+    int64_t write_us;           /* Time spent writing, in micro seconds */
+    uint32_t writes;            /* Number of write calls */
+    uint32_t syncs;             /* Number of file syncs, from SYNCFILE and the group commit policy */
+    int64_t sync_us;            /* Time spent syncing, in micro seconds */
+    int64_t sync_max_us;        /* Longest sync */
+} sd_writer_stats_t;
+
+
+typedef enum {
+    SD_SEGMENT_WRITING,         /* Segment is being written, or waiting for more data */
+    SD_SEGMENT_FINISHED         /* Segment is closed and will not be written again. Can be downloaded */
+} sd_segment_state_t;
+
+/* Segment of a rotated file */
+typedef struct sd_segment {
+    char path[SD_SEGMENT_PATH_MAX];     /* Full path, "/sdcard/dir/name.0001" */
+    uint32_t segment;                   /* Segment number */
+    sd_segment_state_t state;
+    int64_t size;                       /* Size of a finished segment, -1 while writing */
+} sd_segment_t;
+
+
+/* Record of a file opened with SPI_OPEN_TIMESTAMP, little endian. The data of one WRITEFILE packet follows.
+ * Records are never split between segments of a rotated file. */
+#define SD_RECORD_MAGIC             0x31524453      /* "SDR1" */
+
+typedef struct __attribute__((packed)) sd_record_header {
+    uint32_t magic;             /* SD_RECORD_MAGIC */
+    uint32_t len;               /* Bytes of data following the header */
+    int64_t time;               /* Receive time of the packet, micro seconds since 1970 (UTC) */
+} sd_record_header_t;
+
+/* Entry of the time index "file.idx" beside a file opened with SPI_OPEN_TIMESTAMP. Entries are in time order,
+ * the index is sparse: records between two entries are found by reading on from the first. */
+typedef struct __attribute__((packed)) sd_index_entry {
+    int64_t time;               /* Time of the record */
+    uint64_t offset;            /* File offset of its header */
+} sd_index_entry_t;
+
+/*  SD writer task. Executes commands and writes data from received SPI packets to the sd card,
+ *  so the SPI receive task never waits on the card.  */
+void sd_writer_task(void *arg);
+
+/*  Execute the SPI packets already received, then sync and close all files and stop writing, before deep sleep.
+ *  Returns false if not done within timeout_ms. Called from the SD writer task, files are closed right away */
+bool sd_writer_drain(uint32_t timeout_ms);
+
+/*  Get write counters since boot */
+void sd_writer_get_stats(sd_writer_stats_t *out);
+
+/*  Get the latest segments of rotated files, newest first. Returns number of segments copied to out */
+size_t sd_writer_get_segments(sd_segment_t *out, size_t max);
+
+/*  Check if a file is the segment currently written on a rotated stream */
+bool sd_writer_is_writing(const char *path);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* SD_WRITER_H_INCLUDED */
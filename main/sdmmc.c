@@ -4,11 +4,13 @@
   *  */
 
 #include <sys/time.h>
+#include <stdio.h>
 #include <string.h>
 #include "driver/sdmmc_host.h"
 #include "sdmmc_cmd.h"
 #include "esp_vfs_fat.h"
 #include "esp_log.h"
+#include "esp_attr.h"
 #include "driver/sdmmc_defs.h"
 #include "diskio_sdmmc.h"
 #include "sdmmc.h"
@@ -30,6 +32,11 @@ sdmmc_card_t* card = NULL;
 static char * base_path = NULL;
 static FATFS* fs = NULL;
 
+/* Card parameters from the last full card init, kept in RTC memory through deep sleep.
+ * The card stays powered and initialized while the ESP32 sleeps, so it can be used again without probing. */
+static RTC_DATA_ATTR sdmmc_card_t rtc_card;
+static RTC_DATA_ATTR bool rtc_card_valid = false;
+
 static esp_err_t partition_card(const esp_vfs_fat_mount_config_t *mount_config,
                                 const char *drv, sdmmc_card_t *card, BYTE pdrv);
 
@@ -49,14 +56,40 @@ static esp_err_t init_sdmmc_host(int slot, const void *slot_config, int *out_slo
     return sdmmc_host_init_slot(slot, (const sdmmc_slot_config_t*) slot_config);
 }
 
-esp_err_t mount_sd_card(bool format_if_fail) {
+/* Take the card back in use with the parameters saved in RTC memory. The host is set to the bus width and clock
+ * the card was left in, and the card is asked for its status to check it is still initialized. */
+static esp_err_t resume_card(const sdmmc_host_t *host, sdmmc_card_t *card)
+{
+    esp_err_t err;
+
+    if (!rtc_card_valid) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    memcpy(card, &rtc_card, sizeof(sdmmc_card_t));
+    card->host = *host;
+
+    err = host->set_bus_width(host->slot, 1 << card->log_bus_width);
+    if (err == ESP_OK) {
+        err = host->set_card_clk(host->slot, card->max_freq_khz);
+    }
+    if (err == ESP_OK) {
+        err = sdmmc_get_status(card);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Card could not be resumed (0x%x), probing again", err);
+        rtc_card_valid = false;
+    }
+    return err;
+}
+
+static esp_err_t mount(bool format_if_fail, bool resume) {
 
     esp_err_t err;
     uint8_t pdrv = FF_DRV_NOT_USED;
     // If format_if_mount_failed is set to true, SD card will be partitioned and
     // formatted in case mount fails.
     esp_vfs_fat_sdmmc_mount_config_t mount_config = {
-            .max_files = 10,
+            .max_files = SD_MAX_FILES,
             .allocation_unit_size = 16 * 1024
     };
 
@@ -117,8 +150,12 @@ esp_err_t mount_sd_card(bool format_if_fail) {
     CHECK_EXECUTE_RESULT(err, "slot init failed");
 
     // probe and initialize card. This takes some time. 40-60mS.
-    err = sdmmc_card_init(&host, card);
-    CHECK_EXECUTE_RESULT(err, "sdmmc_card_init failed");
+    if (!resume || resume_card(&host, card) != ESP_OK) {
+        err = sdmmc_card_init(&host, card);
+        CHECK_EXECUTE_RESULT(err, "sdmmc_card_init failed");
+        memcpy(&rtc_card, card, sizeof(sdmmc_card_t));
+        rtc_card_valid = true;
+    }
 
     ff_diskio_register_sdmmc(pdrv, card);
     //ESP_LOGI(TAG, "using pdrv=%i", pdrv);
@@ -134,8 +171,9 @@ esp_err_t mount_sd_card(bool format_if_fail) {
         goto fail;
     }
 
-    // Try to mount partition
-    FRESULT res = f_mount(fs, drv, 1);
+    // Try to mount partition. When resuming, the volume is mounted on first file access instead,
+    // so the SPI receiver can be started without reading the boot sector first.
+    FRESULT res = f_mount(fs, drv, resume ? 0 : 1);
 
     if (res != FR_OK) {
         err = ESP_FAIL;
@@ -158,7 +196,9 @@ esp_err_t mount_sd_card(bool format_if_fail) {
             goto fail;
         }
     }
-    sdmmc_card_print_info(stdout, card);
+    if (!resume) {
+        sdmmc_card_print_info(stdout, card);
+    }
 
     return ESP_OK;
 cleanup:
@@ -186,6 +226,14 @@ fail:
     return err;
 }
 
+esp_err_t mount_sd_card(bool format_if_fail) {
+    return mount(format_if_fail, false);
+}
+
+esp_err_t mount_sd_card_resume(void) {
+    return mount(false, true);
+}
+
 
 static esp_err_t partition_card(const esp_vfs_fat_mount_config_t *mount_config,
                                 const char *drv, sdmmc_card_t *card, BYTE pdrv)
@@ -227,6 +275,31 @@ fail:
     return err;
 }
 
+/* Unmount the card, but leave it initialized and the host running, as in deep sleep. FATFS keeps nothing buffered
+ * once the files are closed, so this is only so nothing can use the card after the writer has closed its files. */
+esp_err_t unmount_sd_card(void) {
+
+    if (card == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    BYTE pdrv = ff_diskio_get_pdrv_card(card);
+    if (pdrv == 0xff) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    char drv[3] = {(char)('0' + pdrv), ':', 0};
+
+    f_mount(NULL, drv, 0);
+    esp_vfs_fat_unregister_path(base_path);
+    ff_diskio_unregister(pdrv);
+    free(card);
+    free(base_path);
+    card = NULL;
+    base_path = NULL;
+    fs = NULL;          // Freed by esp_vfs_fat_unregister_path()
+    ESP_LOGI(TAG, "Card unmounted");
+    return ESP_OK;
+}
+
 esp_err_t format_sd_card(void) {
     
     esp_err_t err;
@@ -248,7 +321,7 @@ esp_err_t format_sd_card(void) {
 
     esp_vfs_fat_sdmmc_mount_config_t mount_config = {
             .format_if_mount_failed = true,
-            .max_files = 10,
+            .max_files = SD_MAX_FILES,
             .allocation_unit_size = 16 * 1024
     };
     ESP_LOGW(TAG, "Format SD card !!");
@@ -314,6 +387,31 @@ uint8_t get_freespace_sd(uint32_t *tot, uint32_t *free) {
 
 }
 
+/* Translate a VFS path on the mounted SD card to a path FATFS understands */
+uint8_t get_fat_path(char *dest, const char *path, size_t destsize) {
+
+    uint8_t status = 0;
+    const size_t mount_len = sizeof(SD_MOUNT) - 1;
+
+    if (!card) return status;
+
+    BYTE pdrv = ff_diskio_get_pdrv_card(card);
+    if (pdrv == 0xff) {
+        return status;
+    }
+
+    // skip the mount point, "/sdcard/dir/file" -> "/dir/file"
+    if (strncmp(path, SD_MOUNT, mount_len) == 0) {
+        path += mount_len;
+    }
+
+    if (snprintf(dest, destsize, "%c:%s", (char)('0' + pdrv), path) >= destsize) {
+        return status;
+    }
+    status = 1;
+    return status;
+}
+
 /* Get info from a mounted SD card. Will return Name and frequency*/
 uint8_t get_sdcard_info(char* name, uint16_t* freq_khz) {
     
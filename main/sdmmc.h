@@ -8,6 +8,9 @@ extern "C" {
 
 #define SD_MOUNT    "/sdcard"
 
+/* Maximum number of files that can be open at the same time on the sd card (all tasks) */
+#define SD_MAX_FILES    10
+
 /* Get the current total and free space on a mounted sd-card */
 uint8_t get_freespace_sd(uint32_t* tot, uint32_t* free);
 
@@ -18,6 +21,18 @@ uint8_t get_sdcard_info(char* name, uint16_t* freq_khz);
 *   If format_if_fail is set to true, the card will be formatted to FAT32, if the current partition is not readable. */
 esp_err_t mount_sd_card(bool format_if_fail);
 
+/*  Fast mount after deep sleep. Uses the card parameters saved in RTC memory by the last mount instead of probing
+*   the card, and mounts the volume on first access. Falls back to a full card init if the card does not answer. */
+esp_err_t mount_sd_card_resume(void);
+
+/* Translate a path on the mounted sd-card ("/sdcard/dir/file") to a FATFS path ("0:/dir/file")
+ * Returns 1 on success, 0 if no card is mounted or dest is too small */
+uint8_t get_fat_path(char *dest, const char *path, size_t destsize);
+
+/* Unmount the sd card before deep sleep. All files must be closed. The card stays initialized, so it can be
+ * resumed with mount_sd_card_resume() after wake up */
+esp_err_t unmount_sd_card(void);
+
 /* Format a sd-card that is already mounted */
 esp_err_t format_sd_card(void);
 
@@ -0,0 +1,231 @@
+/*  Periodic polling of the sensor.
+ *
+ *  The readings are written by the poll task only. The rendered JSON is shared with the HTTP server under
+ *  json_lock, and replaced only when it changes, which is also when the ETag version is counted up.
+ *  So nothing in the JSON may change on every round: the sensor clock is served as its offset from the
+ *  device clock, a reading has the time its value changed rather than the time it was last read, and
+ *  failed polls are counted in the log only.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "cJSON.h"
+
+#include "uart_tcp_server.h"
+#include "uart_arbiter.h"
+#include "sensor_poll.h"
+
+
+typedef struct poll_entry {
+    const char *name;           /* Key in the JSON */
+    const char *cmd;            /* Command and reply as in uart_transaction_t */
+    const char *start;
+    const char *end;
+    uint32_t every;             /* Polled every N rounds */
+    bool (*parse)(const struct poll_entry *e, const char *resp, char *value, size_t size);
+} poll_entry_t;
+
+typedef struct reading {
+    char value[SENSOR_POLL_VALUE_SIZE];
+    time_t since;               /* When the value changed to this, 0 = never read */
+    uint32_t errors;            /* Polls without a good reply, for the log */
+    bool ok;                    /* The last poll got a good reply */
+} reading_t;
+
+static bool parse_clock(const poll_entry_t *e, const char *resp, char *value, size_t size);
+static bool parse_text(const poll_entry_t *e, const char *resp, char *value, size_t size);
+
+/* The commands that are polled */
+static const poll_entry_t poll_table[] = {
+    { "clock_offset", "do_get clock\n",         "#",                "#",  1,  parse_clock },
+    { "node",         "get_node description\n", "Node Description", "\n", 20, parse_text  },
+};
+#define POLL_ENTRIES    (sizeof(poll_table) / sizeof(poll_table[0]))
+
+static const char *TAG = "Sensor_poll";
+
+static reading_t readings[POLL_ENTRIES];
+static TaskHandle_t poll_task = NULL;
+static SemaphoreHandle_t json_lock = NULL;
+static char *json = NULL;                       // Under json_lock
+static uint32_t json_version = 0;               // Under json_lock
+static uint32_t boot_id;                        // In the ETag, so a version from before a reboot doesn't match
+
+
+// "#\n2024.01.02 03:04:05\r#" -> seconds the sensor clock is ahead of the device, e.g. "-2".
+// Steady while both clocks run, so it only changes the JSON when one of them is set or drifts a second
+static bool parse_clock(const poll_entry_t *e, const char *resp, char *value, size_t size)
+{
+    struct tm tm = {0};
+    const char *p = resp + strlen(e->start);
+
+    while (*p != '\0' && isspace((unsigned char)*p)) {
+        p++;
+    }
+    if (strptime(p, "%Y.%m.%d %H:%M:%S", &tm) == NULL) {
+        return false;
+    }
+    tm.tm_isdst = -1;
+    time_t sensor = mktime(&tm);
+    if (sensor == (time_t)-1) {
+        return false;
+    }
+    return snprintf(value, size, "%lld", (long long)(sensor - time(NULL))) < (int)size;
+}
+
+// The reply after the start string, without white space at the ends
+static bool parse_text(const poll_entry_t *e, const char *resp, char *value, size_t size)
+{
+    const char *p = resp + strlen(e->start);
+    const char *end = p + strlen(p);
+
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
+    }
+    while (end > p && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    if (p == end) {
+        return false;
+    }
+    size_t len = end - p;
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(value, p, len);
+    value[len] = '\0';
+    return true;
+}
+
+static void poll_one(const poll_entry_t *e, reading_t *r)
+{
+    char resp[129];
+    char value[SENSOR_POLL_VALUE_SIZE];
+    uart_transaction_t t = {
+        .cmd = e->cmd,
+        .start = e->start,
+        .end = e->end,
+        .timeout_ms = UART_QUERY_TIMEOUT_MS,
+        .resp = resp,
+        .resp_size = sizeof(resp),
+    };
+
+    if (uart_arbiter_transact(&t) != ESP_OK) {
+        ESP_LOGD(TAG, "No reply to %s", e->name);
+    } else if (!e->parse(e, resp, value, sizeof(value))) {
+        ESP_LOGW(TAG, "Bad reply to %s", e->name);
+    } else {
+        if (r->since == 0 || strcmp(r->value, value) != 0) {
+            strcpy(r->value, value);
+            r->since = time(NULL);
+        }
+        r->ok = true;
+        return;
+    }
+    // Keep the last good value, with its time
+    r->errors++;
+    if (r->ok) {
+        ESP_LOGW(TAG, "Lost %s, %u failed polls so far", e->name, (unsigned)r->errors);
+    }
+    r->ok = false;
+}
+
+static char *render_json(void)
+{
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "interval", CONFIG_SENSOR_POLL_INTERVAL);
+    cJSON *items = cJSON_AddObjectToObject(root, "readings");
+
+    for (size_t i = 0; i < POLL_ENTRIES; i++) {
+        cJSON *item = cJSON_AddObjectToObject(items, poll_table[i].name);
+        if (readings[i].since == 0) {
+            cJSON_AddNullToObject(item, "value");
+        } else {
+            cJSON_AddStringToObject(item, "value", readings[i].value);
+        }
+        cJSON_AddNumberToObject(item, "since", readings[i].since);
+        cJSON_AddBoolToObject(item, "ok", readings[i].ok);
+    }
+
+    char *out = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return out;
+}
+
+// Replace the shared JSON if it changed. The HTTP server only copies it, so the lock is held briefly
+static void update_json(void)
+{
+    char *fresh = render_json();
+    if (fresh == NULL) {
+        ESP_LOGW(TAG, "Out of memory rendering readings");
+        return;
+    }
+
+    xSemaphoreTake(json_lock, portMAX_DELAY);
+    if (json != NULL && strcmp(json, fresh) == 0) {
+        xSemaphoreGive(json_lock);
+        free(fresh);
+        return;
+    }
+    char *old = json;
+    json = fresh;
+    json_version++;
+    xSemaphoreGive(json_lock);
+    free(old);
+}
+
+static void sensor_poll_task(void *arg)
+{
+    TickType_t last_wake = xTaskGetTickCount();
+    uint32_t round = 0;
+
+    while (1) {
+        for (size_t i = 0; i < POLL_ENTRIES; i++) {
+            if (round % poll_table[i].every == 0) {
+                poll_one(&poll_table[i], &readings[i]);
+            }
+        }
+        update_json();
+        round++;
+        vTaskDelayUntil(&last_wake, CONFIG_SENSOR_POLL_INTERVAL * configTICK_RATE_HZ);
+    }
+}
+
+void sensor_poll_start(void)
+{
+    if (CONFIG_SENSOR_POLL_INTERVAL == 0 || poll_task != NULL) {
+        return;
+    }
+
+    json_lock = xSemaphoreCreateMutex();
+    boot_id = esp_random();
+    update_json();      // Readings without values until the first round is done
+
+    uart_arbiter_start();
+    xTaskCreate(sensor_poll_task, "sensor_poll", 1024*3, NULL, SENSOR_POLL_PRIORITY, &poll_task);
+    ESP_LOGI(TAG, "Polling %u commands every %u s", (unsigned)POLL_ENTRIES, (unsigned)CONFIG_SENSOR_POLL_INTERVAL);
+}
+
+char *sensor_poll_get_json(char *etag, size_t etag_size)
+{
+    if (json_lock == NULL) {
+        return NULL;
+    }
+
+    xSemaphoreTake(json_lock, portMAX_DELAY);
+    char *copy = json != NULL ? strdup(json) : NULL;
+    snprintf(etag, etag_size, "\"%08x.%u\"", (unsigned)boot_id, (unsigned)json_version);
+    xSemaphoreGive(json_lock);
+    return copy;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#ifndef SENSOR_POLL_H_INCLUDED
+#define SENSOR_POLL_H_INCLUDED
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*  Periodic polling of the sensor.
+ *  A task runs the commands in the poll table of sensor_poll.c through the uart arbiter every
+ *  CONFIG_SENSOR_POLL_INTERVAL seconds, and keeps the parsed replies in RAM. The readings are rendered to JSON
+ *  once per poll round, so any number of HTTP clients can read them without uart traffic.
+ *  The JSON has an ETag that changes only when a reading does, for conditional requests.
+ */
+
+#define SENSOR_POLL_PRIORITY        3           /* Below the bridge, polling can wait */
+#define SENSOR_POLL_VALUE_SIZE      48          /* Max length of a parsed reply, including the null */
+#define SENSOR_POLL_ETAG_SIZE       24          /* "\"bootid.version\"" and null */
+
+
+/*  Start the poll task. Does nothing if CONFIG_SENSOR_POLL_INTERVAL is 0 or the task is running */
+void sensor_poll_start(void);
+
+/*  Copy of the latest readings as JSON, the caller frees it. The ETag of the JSON, quoted, is put in etag.
+ *  Returns NULL if polling is not running or out of memory */
+char *sensor_poll_get_json(char *etag, size_t etag_size);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* SENSOR_POLL_H_INCLUDED */
@@ -0,0 +1,126 @@
+/*  Shutdown before deep sleep.
+ *
+ *  Runs in the task that asked for sleep. Each step gets what is left of the budget, and the time of each step is
+ *  logged, so the drain time can be followed from the log.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_sleep.h"
+#include "esp_wifi.h"
+#include "esp_log.h"
+#include "driver/rtc_io.h"
+
+#include "sdmmc.h"
+#include "spi.h"
+#include "sd_writer.h"
+#include "spi_reader.h"
+#include "file_server.h"
+#include "uart_tcp_server.h"
+#include "uart_arbiter.h"
+#include "uart_store.h"
+#include "uart_capture.h"
+#include "wifi_manager.h"
+#include "shutdown.h"
+
+
+static const char *TAG = "Shutdown";
+
+static atomic_flag started = ATOMIC_FLAG_INIT;
+static TaskHandle_t sleep_task = NULL;
+static const char *volatile requested = NULL;
+
+
+// Milli seconds left until deadline, 0 if passed
+static uint32_t remaining_ms(int64_t deadline)
+{
+    return MAX(0, deadline - esp_timer_get_time()) / 1000;
+}
+
+void shutdown_enter_sleep(const char *reason)
+{
+    if (atomic_flag_test_and_set(&started)) {
+        ESP_LOGW(TAG, "Shutdown already in progress (%s)", reason);
+        vTaskSuspend(NULL);
+        return;
+    }
+
+    int64_t start = esp_timer_get_time();
+    int64_t deadline = start + SHUTDOWN_BUDGET_MS * 1000LL;
+    ESP_LOGI(TAG, "Shutdown before deep sleep: %s", reason);
+
+    // Received data first. The servers only read files, except uploads, which finish when the server stops.
+    bool drained = sd_writer_drain(remaining_ms(deadline));
+    int64_t drain_done = esp_timer_get_time();
+    if (!drained) {
+        ESP_LOGW(TAG, "SD writer not done after %u ms, files may not be closed", SHUTDOWN_BUDGET_MS);
+    }
+
+    // httpd_stop() can not be given a timeout, so it is only tried with time left
+    bool bridge_stopped = false;
+    if (remaining_ms(deadline) > 0) {
+        bridge_stopped = stop_tcp_server(remaining_ms(deadline));
+        stop_file_server();
+    }
+    // The sensor keeps its rate while we sleep, and uart_init() starts at the default after wake up
+    if (uart_arbiter_get_baud() != UART_BAUD_DEFAULT && remaining_ms(deadline) > 0) {
+        uart_arbiter_set_baud(UART_BAUD_DEFAULT, remaining_ms(deadline));
+    }
+    int64_t servers_done = esp_timer_get_time();
+
+    // Need to stop wifi before going to sleep
+    if (wifi_manager_get_esp_netif_ap() != NULL) {
+        esp_wifi_stop();
+        esp_wifi_deinit();
+    }
+
+    // An unmount with files open would not make the card any cleaner, leave it to the next mount.
+    // The uart store belongs to the bridge task, and is only closed when that has ended.
+    if (drained && bridge_stopped && remaining_ms(deadline) > 0 && spi_reader_close(remaining_ms(deadline))
+            && uart_capture_stop(remaining_ms(deadline))) {
+        uart_store_close();
+        unmount_sd_card();
+    }
+    int64_t end = esp_timer_get_time();
+
+    ESP_LOGI(TAG, "Drained SPI writer in %lli ms, servers stopped in %lli ms, card unmounted in %lli ms. %lli ms of %u ms budget",
+            (drain_done - start) / 1000, (servers_done - drain_done) / 1000, (end - servers_done) / 1000,
+            (end - start) / 1000, SHUTDOWN_BUDGET_MS);
+
+    // Isolate GPIO12 pin from external circuits. This is needed for modules
+    // which have an external pull-up resistor on GPIO12 (such as ESP32-WROVER)
+    // to minimize current consumption.
+    rtc_gpio_isolate(GPIO_NUM_12);
+
+    spi_save_state();
+
+    //esp_sleep_pd_config(ESP_PD_DOMAIN_MAX, ESP_PD_OPTION_OFF);
+    esp_deep_sleep_start();
+}
+
+void shutdown_set_sleep_task(TaskHandle_t task)
+{
+    sleep_task = task;
+}
+
+void shutdown_request_sleep(const char *reason)
+{
+    if (sleep_task == NULL) {
+        ESP_LOGE(TAG, "No sleep task, can not shut down (%s)", reason);
+        return;
+    }
+    requested = reason;
+    vTaskResume(sleep_task);
+}
+
+const char *shutdown_requested_reason(void)
+{
+    return requested;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#ifndef SHUTDOWN_H_INCLUDED
+#define SHUTDOWN_H_INCLUDED
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*  Shutdown before deep sleep.
+ *  Everything that goes to sleep goes through shutdown_enter_sleep(), so buffered data is written and the FAT is
+ *  clean when the card is mounted again after wake up. In order:
+ *    - the SD writer executes the packets already received, then syncs and closes its files
+ *    - the HTTP and TCP servers are stopped, and the TCP server task has ended
+ *    - the sensor uart is set back to the default baud rate
+ *    - Wi-Fi is stopped, the read back file and the uart capture are closed, the uart store is written to its
+ *      spill file and the card is unmounted
+ *  Steps that do not fit in SHUTDOWN_BUDGET_MS are skipped, so the device always goes to sleep in bounded time.
+ */
+
+/* Time allowed from the sleep request to deep sleep */
+#define SHUTDOWN_BUDGET_MS      CONFIG_SHUTDOWN_BUDGET_MS
+
+
+/*  Shut down and enter deep sleep. Does not return. Can be called from any task, also the SD writer.
+ *  A second call while a shutdown is in progress blocks the calling task */
+void shutdown_enter_sleep(const char *reason);
+
+/*  The task that calls shutdown_enter_sleep() when it is resumed, for shutdown_request_sleep() */
+void shutdown_set_sleep_task(TaskHandle_t task);
+
+/*  Resume the sleep task to shut down, without waiting for it. For callers that must not block, like timer
+ *  callbacks, which run in the timer service task */
+void shutdown_request_sleep(const char *reason);
+
+/*  Reason given to shutdown_request_sleep(), NULL if it was not called */
+const char *shutdown_requested_reason(void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* SHUTDOWN_H_INCLUDED */
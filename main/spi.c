@@ -1,33 +1,73 @@
+/*  SPI slave receiver.
+ *
+ *  The SPI task only receives packets. Every received buffer is handed to the SD writer task
+ *  through a lock-free ring and the transaction is queued again at once with a free buffer from the pool,
+ *  so a slow sd card write never keeps the handshake line low.
+ */
+
 #include <sys/time.h>
 #include <stdio.h>
+#include <assert.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
 
 #include <sys/param.h>
-#include <sys/unistd.h>
-#include <sys/stat.h>
-#include "esp_sleep.h"
-#include "esp_wifi.h"
-#include "driver/rtc_io.h"
-
-//#include "esp_crc.h"
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_attr.h"
+#include "esp_crc.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_spi_flash.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "driver/spi_slave.h"
 #include "driver/gpio.h"
 
-#include "uart_tcp_server.h"
-#include "sdmmc.h"
-#include "file_server.h"
 #include "spi.h"
-#include "wifi_manager.h"
+#include "spsc_ring.h"
+#include "spi_reader.h"
+#include "sd_writer.h"
+
+
+
+_Static_assert(SPI_POOL_SIZE > MAX_SPI_MESSAGES, "SPI_RX_POOL_BUFFERS must be larger than MAX_SPI_MESSAGES");
+
+/* Buffer pool. Buffers circulate: free ring -> queued SPI transaction -> received ring -> SD writer -> free ring */
+static spi_buffer_t pool[SPI_POOL_SIZE];
+static spsc_ring_t free_ring;           // Producer: SD writer task.  Consumer: SPI task
+static spsc_ring_t received_ring;       // Producer: SPI task.        Consumer: SD writer task
 
+static TaskHandle_t writer_handle = NULL;
+// Buffers owned by the SPI task that are not queued: rejected packets and failed queueing. Used before taking one
+// from the free ring. The SPI task can not give them back there, the SD writer is the only producer of that ring.
+static spi_buffer_t *spares[SPI_POOL_SIZE];
+static int spare_count = 0;
 
+// Array of SPI transactions.
+static spi_slave_transaction_t spi_trans[MAX_SPI_MESSAGES];
+static uint8_t *tx_read[MAX_SPI_MESSAGES];  // Read back block sent by each transaction, NULL for a status only
+static uint8_t *read_spare = NULL;      // Read back block taken from the reader that could not be queued
+static int queued = 0;                  // Number of transactions queued in the driver
+static atomic_int queue_depth;          // Number of transactions to keep queued, set at runtime by the master
 
-static const int maxMessages = MAX_SPI_MESSAGES;       //SPI message buffer size. Buffer size: maxMessages*SPI_PKT_SIZE
+/* Transmit buffer with the status reply. Each transaction starts at its own SPI_STATUS_SIZE slot, and runs on
+ * into the slots of the following transactions. The master only reads the first SPI_STATUS_SIZE bytes, so a slot
+ * can be updated while the transactions before it are on the bus.  Size: MAX_SPI_MESSAGES * SPI_STATUS_SIZE + SPI_TRANS_SIZE */
+static uint8_t *tx_status = NULL;
 
-static uint8_t spiQueueBit;          // We set these bits high when we queue a message and low when we receive a message
+static atomic_uint backlog_bytes;       // Received bytes not yet written by the SD writer
+static uint32_t last_seq = 0;           // Sequence number of the last accepted packet
+static uint16_t crc_errors = 0;         // Packets dropped due to wrong CRC or length
+static uint16_t seq_errors = 0;         // Packets dropped due to unexpected sequence number
+static bool first_packet = true;        // Boot to first packet time is logged once
+
+/* Receiver state kept through deep sleep, see spi_save_state(). rtc_queue_depth is 0 if nothing is saved */
+static RTC_DATA_ATTR int rtc_queue_depth = 0;
+static RTC_DATA_ATTR uint32_t rtc_last_seq = 0;
 
 
 static const char *TAG="SPI_receiver";
@@ -40,8 +80,164 @@ void IRAM_ATTR my_post_setup_cb(spi_slave_transaction_t *trans) {
 //Called after transaction is received. We use this to set the handshake line low.
 void IRAM_ATTR my_post_trans_cb(spi_slave_transaction_t *trans) {
     WRITE_PERI_REG(GPIO_OUT_W1TC_REG, (1<<GPIO_HANDSHAKE));
-    // set bit low to indicate buffer is received
-    CLEAR_BIT(spiQueueBit, ((int)trans->user));
+}
+
+// Ring size is the next power of two above the pool size, so the rings can never be full.
+static size_t ring_size(void)
+{
+    size_t size = 2;
+    while (size <= SPI_POOL_SIZE) {
+        size <<= 1;
+    }
+    return size;
+}
+
+spi_buffer_t *spi_get_received(TickType_t ticks_to_wait)
+{
+    spi_buffer_t *buf = spsc_ring_pop(&received_ring);
+
+    // Nothing received. Wait for the SPI task to notify us.
+    while (buf == NULL) {
+        if (ulTaskNotifyTake(pdTRUE, ticks_to_wait) == 0) {
+            return spsc_ring_pop(&received_ring);
+        }
+        buf = spsc_ring_pop(&received_ring);
+    }
+    return buf;
+}
+
+bool spi_set_queue_depth(int depth)
+{
+    if (depth < 1 || depth > MAX_SPI_MESSAGES) {
+        return false;
+    }
+    atomic_store(&queue_depth, depth);
+    return true;
+}
+
+void spi_release_buffer(spi_buffer_t *buf)
+{
+    atomic_fetch_sub(&backlog_bytes, buf->len);
+    spsc_ring_push(&free_ring, buf);
+}
+
+// Fill in the status reply the master receives on MISO during the transaction.
+// read is set when a read back block follows the status.
+static void set_status(uint8_t *dest, uint8_t read)
+{
+    uint8_t free_buffers = spsc_ring_count(&free_ring) + spare_count;
+    int depth = atomic_load(&queue_depth);
+
+    spi_status_t status = {
+        .magic = SPI_STATUS_MAGIC,
+        .queued = queued,
+        .free_buffers = free_buffers,
+        .backlog = spsc_ring_count(&received_ring),
+        .last_seq = last_seq,
+        .backlog_bytes = atomic_load(&backlog_bytes),
+        .crc_errors = crc_errors,
+        .seq_errors = seq_errors,
+        // Every received packet is replaced by a free buffer right away, so the master can send the queued
+        // transactions plus one per free buffer before it has to wait for the SD writer.
+        .credits = MIN(queued + free_buffers, 255),
+        .queue_depth = depth,
+        .read = read,
+    };
+    memcpy(dest, &status, sizeof(status));
+}
+
+#ifdef CONFIG_SPI_PROTOCOL_V2
+// Check CRC and sequence number of a received packet. Only packets passing the check are given to the SD writer.
+static bool accept_packet(spi_buffer_t *buf)
+{
+    const uint8_t *data = (const uint8_t *)buf->data;
+    uint16_t length = (data[2] << 8) | data[1];
+    uint32_t seq, crc;
+
+    memcpy(&seq, data + SPI_SEQ_OFFSET, sizeof(seq));
+    memcpy(&crc, data + SPI_CRC_OFFSET, sizeof(crc));
+
+    if (buf->len < SPI_HEADER_SIZE || length > SPI_BLOCK_SIZE || buf->len < SPI_HEADER_SIZE + length) {
+        crc_errors++;
+        return false;
+    }
+
+    // CRC-32 (same as zlib crc32) of header up to the CRC field, followed by the body.
+    uint32_t calc = esp_crc32_le(0, data, SPI_CRC_OFFSET);
+    calc = esp_crc32_le(calc, data + SPI_HEADER_SIZE, length);
+    if (calc != crc) {
+        crc_errors++;
+        return false;
+    }
+
+    // Sequence number 0 (re)starts the sequence, so a master can reset without the slave being reset.
+    // Anything else must follow the last accepted packet. Repeated packets are dropped, so the master
+    // can simply retransmit everything after last_seq in the status reply.
+    if (seq != 0 && seq != last_seq + 1) {
+        seq_errors++;
+        return false;
+    }
+    last_seq = seq;
+    return true;
+}
+#endif
+
+// Set up a free buffer on SPI transaction and queue it. Returns false if no buffers are free.
+static bool queue_transaction(spi_slave_transaction_t *trans)
+{
+    int slot = trans - spi_trans;
+
+    spi_buffer_t *buf = spare_count > 0 ? spares[--spare_count] : spsc_ring_pop(&free_ring);
+    if (buf == NULL) {
+        trans->user = NULL;
+        return false;
+    }
+
+    // Send a prefetched read back block if one is ready, otherwise only the status
+    uint8_t *read_block = read_spare;
+    read_spare = NULL;
+    if (read_block == NULL) {
+        read_block = spi_reader_get_block();
+    }
+
+    trans->length = SPI_TRANS_SIZE*8;           // Lenght of transaction in bits
+    trans->rx_buffer = buf->data;               // Receive buffer
+    trans->user = buf;                          // Used to find the pool buffer when the transaction returns
+    if (read_block != NULL) {
+        trans->tx_buffer = read_block;          // Status, read header and file data
+        set_status(read_block, 1);
+    } else {
+        trans->tx_buffer = tx_status + slot * SPI_STATUS_SIZE;     // Status reply to master
+        set_status(tx_status + slot * SPI_STATUS_SIZE, 0);
+    }
+    tx_read[slot] = read_block;
+
+    if (spi_slave_queue_trans(RCV_HOST, trans, 0) != ESP_OK) {
+        printf("ERROR: SPI message could not be queued !\n");
+        spares[spare_count++] = buf;
+        read_spare = read_block;
+        tx_read[slot] = NULL;
+        trans->user = NULL;
+        return false;
+    }
+    queued++;
+    return true;
+}
+
+void spi_save_state(void)
+{
+    rtc_queue_depth = atomic_load(&queue_depth);
+    rtc_last_seq = last_seq;
+}
+
+// Queue idle transactions until the queue depth is reached or the pool runs out of buffers
+static void fill_queue(void)
+{
+    for (int k=0; k < MAX_SPI_MESSAGES && queued < atomic_load(&queue_depth); k++) {
+        if (spi_trans[k].user == NULL && !queue_transaction(&spi_trans[k])) {
+            break;
+        }
+    }
 }
 
 void init_esp32_spi_slave()
@@ -55,7 +251,7 @@ void init_esp32_spi_slave()
         .sclk_io_num=GPIO_SCLK,
         .quadwp_io_num = -1,
         .quadhd_io_num = -1,
-        .max_transfer_sz = MAX(4092, SPI_PKT_SIZE),     // Default size is 4092. Needs to be increased when using longers SPI messages than 4092.
+        .max_transfer_sz = MAX(4092, SPI_TRANS_SIZE),     // Default size is 4092. Needs to be increased when using longers SPI messages than 4092.
         .flags = 0,
     };
 
@@ -97,327 +293,108 @@ void init_esp32_spi_slave()
 
 void SPI_task (void *arg)
 {
-    char path[FILE_PATH_MAX] = {0};         //file path
-    FILE* file = NULL;                      //FILE pointer
-    eControl msgCode = 0;                   //SPI Message code
-
-    uint16_t spi_trans_len = 0;
-    const size_t sd_mount_len = sizeof(BASE_PATH) - 1;         //Length of sd card base folder
-    int spi_id = 0;
-    
-    //esp_log_level_set(TAG, ESP_LOG_INFO);
-
     esp_err_t ret;
-    
-    //  SPI receive buffers. This needs to be word alligned and a multiple of 4, due to DMA restrictions in ESP32.
-    WORD_ALIGNED_ATTR char * recvbuf[maxMessages]; //= (char *)malloc(maxMessages * sizeof(char*));
-    // Create an array of SPI transactions.
-    spi_slave_transaction_t spi_trans[maxMessages];
+
     // Pointer to the SPI transaction that currently has been received.
     spi_slave_transaction_t *ret_trans;
 
-    char * currentBuffer = NULL;
-    
-    spiQueueBit = 0;          // We set these bits high when we queue a message and low when we receive a message
+    //esp_log_level_set(TAG, ESP_LOG_INFO);
 
-    //init SPI slave device
-    init_esp32_spi_slave();
+    if (!spsc_ring_init(&free_ring, ring_size()) || !spsc_ring_init(&received_ring, ring_size())) {
+        ESP_LOGE(TAG, "Failed to allocate SPI buffer rings");
+        vTaskDelete(NULL);
+        return;
+    }
 
+    //  SPI receive buffers. This needs to be word alligned, a multiple of 4 and in DMA capable memory, due to DMA restrictions in ESP32.
+    for (int k=0; k < SPI_POOL_SIZE; k++) {
+        pool[k].data = (char*)heap_caps_malloc(SPI_TRANS_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_32BIT);
+        pool[k].len = 0;
+        if (pool[k].data == NULL) {
+            ESP_LOGE(TAG, "Failed to allocate SPI buffer %i", k);
+            continue;
+        }
+        spsc_ring_push(&free_ring, &pool[k]);
+    }
 
-    // Prepare a set of SPI transactions 
-    for (int k=0; k < maxMessages; k++) {
-        recvbuf[k] = (char*)malloc(SPI_PKT_SIZE);
-        spi_trans[k].user = malloc(sizeof(int));
+    // Status reply buffer, see tx_status.
+    tx_status = (uint8_t*)heap_caps_calloc(1, MAX_SPI_MESSAGES * SPI_STATUS_SIZE + SPI_TRANS_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_32BIT);
+    if (tx_status == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate SPI status buffer");
+        vTaskDelete(NULL);
+        return;
+    }
+    atomic_init(&backlog_bytes, 0);
+    atomic_init(&queue_depth, SPI_QUEUE_DEPTH);
+    if (esp_reset_reason() == ESP_RST_DEEPSLEEP && rtc_queue_depth > 0) {
+        atomic_store(&queue_depth, rtc_queue_depth);
+        last_seq = rtc_last_seq;
+    }
 
-        memset(recvbuf[k], 0xee, SPI_PKT_SIZE);
-        memset(&spi_trans[k], 0, sizeof(spi_trans[k]));
+    // Start the task writing received messages to the sd card. Lower priority than this task, so receive is never blocked.
+    xTaskCreate(sd_writer_task, "SD_writer", 1024*4, NULL, SD_WRITER_PRIORITY, &writer_handle);
 
-        spi_trans[k].length=SPI_PKT_SIZE*8;             // Lenght of transaction in bits
-        spi_trans[k].rx_buffer= recvbuf[k];              // Receive buffer
-        spi_trans[k].tx_buffer=NULL;                    // No transmit phase
-        spi_trans[k].user = ((int*)k);                  // Used to store transaction ID.
+    //init SPI slave device
+    init_esp32_spi_slave();
 
-        ret = spi_slave_queue_trans(RCV_HOST, &spi_trans[k], 0);
-       
-        if (ret == ESP_OK) 
-        {
-            SET_BIT(spiQueueBit, k);            //Set SPI message queue bit
-        } else 
-        {
-            printf("ERROR: SPI message %i not queued ! \n", k);
-        }
+    // Prepare a set of SPI transactions
+    memset(spi_trans, 0, sizeof(spi_trans));
+    fill_queue();
+    if (queued < atomic_load(&queue_depth)) {
+        printf("ERROR: Only %i of %i SPI messages queued ! \n", queued, atomic_load(&queue_depth));
     }
 
-    ESP_LOGI(TAG, "Waiting for SPI messages");
+    ESP_LOGI(TAG, "Waiting for SPI messages, %lli ms after boot", esp_timer_get_time() / 1000);
 
     // This loop will wait for SPI messages forever
-    do {          
-        //Wait here until SPI message is received or ticks_to_wait is expired. If set to portMAX_DELAY, will wait forever.
-        ret = spi_slave_get_trans_result(RCV_HOST, &ret_trans, 1000/portTICK_RATE_MS);  // 1000/portTICK_RATE_MS to wait 1000ms
-        
-        // Check if message was received or spi_slave_get_trans_result timed out.
-        if (ret == ESP_OK) 
+    do {
+        // If the queue is not full, poll so transactions can be queued as soon as the SD writer returns a buffer.
+        TickType_t ticks_to_wait = (queued < atomic_load(&queue_depth)) ? 1 : portMAX_DELAY;
+
+        ret = spi_slave_get_trans_result(RCV_HOST, &ret_trans, ticks_to_wait);
+
+        if (ret == ESP_OK)
         {
-            //Get id from returned SPI transaction
-            spi_id = ((int)ret_trans->user);
+            spi_buffer_t *buf = (spi_buffer_t *)ret_trans->user;
+            ret_trans->user = NULL;
+            queued--;
+
+            // The read back block has been clocked out, the reader can fill it again
+            int slot = ret_trans - spi_trans;
+            if (tx_read[slot] != NULL) {
+                spi_reader_release_block(tx_read[slot]);
+                tx_read[slot] = NULL;
+            }
 
-            // Pointer to returned message buffer
-            currentBuffer = ret_trans->rx_buffer;
+            // Detected message length. trans_len is in bits.
+            buf->len = ret_trans->trans_len / 8;
 
-            // Detected message length
-            spi_trans_len = ret_trans->trans_len;
-        
             //if transmission length is 0 it means we did not receive any data, probably noise or somehing on CS and clock line
-            if(spi_trans_len > 0) 
-            {   
-                msgCode = currentBuffer[0];                                     // Command byte of SPI message
-                uint16_t length = (currentBuffer[2] << 8) | (currentBuffer[1]); // Length of SPI message
-                const char * spi_data = currentBuffer + SPI_HEADER_SIZE;        // Body of SPI message
-
-                switch (msgCode) {
-                
-                case WRITEFILE:
-                
-                    // If the file has been closed, then try to reopen the file
-                    if (file == NULL) {             
-                        file = fopen(path, "ab");
-                        if (file == NULL) {
-                            printf("Cannot open file for writing %s\n", path);
-                            
-                            break;
-                        }
-                    }
-
-                    size_t remaining = length;
-                    
-                    size_t bytes_written=0;
-
-            
-                    do {
-
-                        /* Write received data to sd card */
-                        int written = fwrite(spi_data, 1, MIN(SPI_BLOCK_SIZE, remaining), file);
-                    
-                        // CRC is not used:
-                        // crc = esp_crc32_be( crc, (const uint8_t *)spi_data,  MIN(SPI_BLOCK_SIZE, remaining));
-                        
-                        remaining -= written;
-
-                        if (remaining > 0) 
-                        {
-                            if ( ret_trans == &spi_trans[spi_id] && !(IS_BIT_SET(spiQueueBit, spi_id)) ) 
-                            {
-                                    // clear buffer
-                                    memset(recvbuf[spi_id], 0xee, SPI_PKT_SIZE);
-                                    // Queue up the last received spi transaction
-                                    ret = spi_slave_queue_trans(RCV_HOST, &spi_trans[spi_id], 0);
-                                    if (ret != ESP_OK) {
-                                        printf("SPI message %i could not be queued\n", spi_id);
-                                    } 
-                                    else 
-                                    {             
-                                        //set bit to indicate buffer has been queued successfully
-                                        SET_BIT(spiQueueBit, spi_id);
-                                        // clear buffer
-                                        memset(recvbuf[spi_id], 0xee, SPI_PKT_SIZE);
-                                    }
-
-                            }
-                    
-
-                            // Wait here until SPI transmission is received or times out, ticks_to_wait. If SPI transmission is already received in the backgound, we will not wait.
-                            ret = spi_slave_get_trans_result(RCV_HOST, &ret_trans, 1000/portTICK_RATE_MS);
-                            
-                            if (ret != ESP_OK) {
-                                printf("Could not receive message! No messages queued or received since last time!\n");
-                                goto END;
-                            } else {
-                                spi_id = ((int)ret_trans->user);
-                            }
-                            spi_data = ret_trans->rx_buffer;            
-                        }
-
-                        bytes_written += written;
-                    
-
-                    } while (remaining != 0);
-
-                    printf("WRITE COMMAND Received:   Received bytes vs written bytes: %i bytes vs %i bytes \n", length, bytes_written); 
-                  
-                    break;
-
-                case OPEN_FILE:
-                    
-                    if (length > FILE_PATH_MAX) {
-                        printf("Path length cannot be longer than %i characters,  Received: %i\n", FILE_PATH_MAX, length);
-                        break;
-                    }
-                    
-                    // replace all '\' with '/' in path string
-                    replacechar(currentBuffer + SPI_HEADER_SIZE, '\\', '/');
-
-                    // Check if file is already open and open file if need to
-                    // If the file is already open, we save a couple of milli seconds.
-                    if (strncmp(path + sd_mount_len, spi_data, length) != 0 )
-                    {
-                        //printf(" Old path: %s   |   New path: %s\n", path + sd_mount_len + 1, spi_data);
-                        // Clear path variable and then build up received path
-                        memset(path, 0, sizeof(path));
-                        strcpy(path, BASE_PATH);
-                        strncat(path, spi_data, length);
-
-                        /* If another files open, close it */
-                        if (file != NULL) {
-                            fclose(file);
-                            printf("Open file closed\n");
-                        }
-                        file = fopen(path, "ab");
-                        //ab = Opens a file for appending in binary mode. If not exist, then create file.
-                        if (file == NULL) {
-                            printf("Cannot open file %s\n", path);
-                        } else {
-                            /* Increase internal write buffer from 128 bytes to the blocksize we use. Needs to be run per file we open */
-                            setvbuf(file, NULL, _IOFBF, SPI_BLOCK_SIZE);
-                        }
-                    } else if ((file == NULL) && (strlen(path) > 0)) {
-                        file = fopen(path, "ab");
-                        if (file == NULL) {
-                            printf("Cannot open file %s\n", path);
-                        } else {
-                            /* Increase internal write buffer from 128 bytes to whater blocksize we use. Needs to be run per file we open */
-                            setvbuf(file, NULL, _IOFBF, SPI_BLOCK_SIZE);
-                        }
-                    }
-
-                    printf("\nOPEN FILE COMMAND Received: Length: %i bytes  |  filename: %s\n", length, path); 
-
-                    break;
-
-                
-                case MAKEDIR:
-
-                    if (length > FILE_PATH_MAX) {
-                        printf("Path length cannot be longer than 255 characters");
-                        break;
-                    }
-                    currentBuffer[length + SPI_HEADER_SIZE] = '\0';         // Null terminate path
-                    //printf("Received path: %s\n", spi_data);
-
-                    char * folder_path = (char*)malloc(length + sd_mount_len + 1);         // Allocate memmory for path + extra byte for '/' and a terminating 0 byte.
-                    strcpy(folder_path, BASE_PATH);
-                    strncat(folder_path, spi_data, length);
-
-                    // We are done with this buffer, so we can return it to the queue:
-                    if ( (ret_trans == &spi_trans[spi_id]) && !(IS_BIT_SET(spiQueueBit, spi_id))) 
-                    {
-                        // reset memory
-                        memset(recvbuf[spi_id], 0xee, SPI_PKT_SIZE);
-                        // Queue up SPI message as we are done with this buffer
-                        ret = spi_slave_queue_trans(RCV_HOST, &spi_trans[spi_id], 0);
-
-                        if (ret != ESP_OK) {
-                            printf("SPI message %i could not be queued\n", spi_id);
-                        } else {                               
-                            //set bit to indicate buffer has been queued successfully
-                            SET_BIT(spiQueueBit, spi_id);
-                        }
-                    }
-
-
-                    if (mkdir(folder_path, S_IRWXU ) == 0) {    // S_IRWXU = chmod 777 
-                        printf("MAKEDIR COMMAND: Directory created: %s\n", folder_path);
-                    } else {
-                        printf("MAKEDIR COMMAND: Directory already exists or could not be created: %s\n", folder_path);
-                    }                   
-                    free(folder_path);
-                    break;
-
-                case  CLOSE_FILE:
-                    if (file != NULL) 
-                    {
-                        fclose(file);
-                        file = NULL;
-                        
-                        printf("FILE CLOSE COMMAND: %s !\n", path);
-                    }
-                    break;
-
-                case  SYNCFILE:
-                    if (file != NULL) 
-                    {                       
-                        fflush(file);
-                        fsync(fileno(file));
-                        printf("FILE SYNC COMMAND: %s !\n", path);
-                    }
-                    break;
-                
-                case SLEEP:
-
-                        ESP_LOGI(TAG, "Enter deep sleep");
-
-                        // Need to stop wifi before going to sleep
-                        if (wifi_manager_get_esp_netif_ap() != NULL) {
-                            esp_wifi_stop();
-                            esp_wifi_deinit();
-                        }
-
-                        // Isolate GPIO12 pin from external circuits. This is needed for modules
-                        // which have an external pull-up resistor on GPIO12 (such as ESP32-WROVER)
-                        // to minimize current consumption.
-                        rtc_gpio_isolate(GPIO_NUM_12);
-
-                        //esp_sleep_pd_config(ESP_PD_DOMAIN_MAX, ESP_PD_OPTION_OFF);
-                        esp_deep_sleep_start();
-
-                    break;
-
-                default:
-                    
-                    printf("UNKNOWN COMMAND byte: 0x%X     -  transmission length: %i\n", currentBuffer[0], spi_trans_len/8 );
-                    break;
-                }
-                
-            }              
-
-            END:
-            // check if any buffers needs to be queued.
-            for (int k=0; k < maxMessages; k++) {            
-                if ( !(IS_BIT_SET(spiQueueBit, k))) 
-                {
-                    // reset buffer to something sane
-                    memset(recvbuf[k], 0xee, SPI_PKT_SIZE);
-                    // Queue up message
-                    ret = spi_slave_queue_trans(RCV_HOST, &spi_trans[k], 0);
-                            
-                    if (ret != ESP_OK) {
-                        printf("SPI message %i could not be queued\n", spi_id);
-                    } 
-                    else 
-                    {                               
-                        //set bit to indicate buffer has been queued successfully
-                        SET_BIT(spiQueueBit, k);
-                    }
+            bool accept = buf->len > 0;
+#ifdef CONFIG_SPI_PROTOCOL_V2
+            accept = accept && accept_packet(buf);
+#endif
+            if (accept) {
+                if (first_packet) {
+                    first_packet = false;
+                    // Time since the application started, the bootloader is not included
+                    ESP_LOGI(TAG, "First SPI packet received %lli ms after boot", esp_timer_get_time() / 1000);
                 }
+                buf->time = esp_timer_get_time();
+                buf->backlog = spsc_ring_count(&received_ring);
+                atomic_fetch_add(&backlog_bytes, buf->len);
+                // Hand the buffer to the SD writer and queue a transaction again with a fresh buffer.
+                spsc_ring_push(&received_ring, buf);
+                xTaskNotifyGive(writer_handle);
+            } else {
+                spares[spare_count++] = buf;
             }
+        }
 
-        } else {
-            // if spi_slave_get_trans_result times out, close open file. Open file is not allowed to be downloaded through the web interface.
-            if (file != NULL) {
-                fclose(file);
-                file = NULL;
-                ESP_LOGI(TAG, "file closed: %s\n", path);
-            }
-        }   
+        // Queue transactions with free buffers
+        fill_queue();
     } while (1);
-    
-    /* Never reached */
-    for (int k=0; k < maxMessages; k++) 
-    {
-        free(recvbuf[k]);
-        free(spi_trans[k].user);
-        printf("Buffer freed: %i\n", k);
-    }
-    free(recvbuf);
 
+    /* Never reached */
     vTaskDelete(NULL);
-}
\ No newline at end of file
+}
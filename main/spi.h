@@ -3,6 +3,10 @@
 #ifndef SPI_H_INCLUDED
 #define SPI_H_INCLUDED
 
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -29,24 +33,98 @@ extern "C" {
  * This should be set up as a factor of 512 for most efficent writes to SD-card.                   *
  *                
  */
+#ifdef CONFIG_SPI_PROTOCOL_V2
+#define SPI_HEADER_SIZE     12
+#define SPI_SEQ_OFFSET      4
+#define SPI_CRC_OFFSET      8
+#else
 #define SPI_HEADER_SIZE     4
+#endif
 #define SPI_BLOCK_SIZE     4096         
 #define SPI_PKT_SIZE        (SPI_BLOCK_SIZE + SPI_HEADER_SIZE)
 
+/* A transaction carrying read back data on MISO is longer than a packet: status, read header and one block.
+ * Transactions and receive buffers are sized for the longer of the two. */
+#define SPI_READ_PKT_SIZE   (SPI_STATUS_SIZE + SPI_READ_HEADER_SIZE + SPI_BLOCK_SIZE)
+#define SPI_TRANS_SIZE      (SPI_READ_PKT_SIZE > SPI_PKT_SIZE ? SPI_READ_PKT_SIZE : SPI_PKT_SIZE)
+
 #define FILE_PATH_MAX       255
 #define FOLDER_NAME_MAX     128
 
 
-/* Size of SPI message buffer 
- * Allocated memmory: MAX_SPI_MESSAGES * SPI_PKT_SIZE
+/* Maximum number of SPI transactions queued in the driver. The master can change the number at runtime with
+ * SET_QUEUE_DEPTH, up to this value. Buffers come from the pool below.
  */
-#define MAX_SPI_MESSAGES    4     
+#define MAX_SPI_MESSAGES    8
+#define SPI_QUEUE_DEPTH     CONFIG_SPI_QUEUE_DEPTH     /* Queue depth at boot */
+
+/* Number of DMA receive buffers in the pool shared by the SPI receiver and the SD writer.
+ * Must be larger than MAX_SPI_MESSAGES, the rest absorbs SD card write latency.
+ * Allocated memmory: SPI_POOL_SIZE * SPI_TRANS_SIZE
+ */
+#define SPI_POOL_SIZE       CONFIG_SPI_RX_POOL_BUFFERS
+
+/* Priority of the SD writer task. Must be lower than the SPI receive task */
+#define SD_WRITER_PRIORITY  15
+
+/* Number of files the master can have open at the same time. Selected with the stream ID in the header */
+#define SPI_MAX_STREAMS     8
 
 /* PACKAGE FORMAT :
 
 |    Byte 1     |    Byte 2     |    Byte 3     |     Byte 4    |     Byte 5 - BLOCKSIZE+HEADER     | 
-|  Command byte |  Length MSB   |  Length LSB   |      Not used |           Body                    |   
+|  Command byte |  Length LSB   |  Length MSB   |  Stream ID    |           Body                    |   
+
+Stream ID selects which of the open files the command applies to (0 - SPI_MAX_STREAMS-1).
+Masters that do not use streams send 0.
+
+A WRITEFILE with length above SPI_BLOCK_SIZE continues in the following packets. These have no header,
+data starts at byte 1.
+
+PROTOCOL V2 (CONFIG_SPI_PROTOCOL_V2):
+
+|  Byte 1 - 4                   |  Byte 5 - 8                   |  Byte 9 - 12                  |  Byte 13 - BLOCKSIZE+HEADER   |
+|  Header as above              |  Sequence number (LSB first)  |  CRC32 (LSB first)            |           Body                |
+
+CRC32 is calculated over byte 1 - 8 followed by the body (standard CRC-32, same as zlib crc32).
+Every packet has a header, so WRITEFILE length cannot be above SPI_BLOCK_SIZE.
+The sequence number is incremented for every packet. Sequence number 0 restarts the sequence.
+Packets with wrong CRC or sequence number are dropped, the master retransmits from last_seq + 1 in the status reply.
+
+STATUS REPLY:
+
+Every transaction sends a spi_status_t on MISO, in the first SPI_STATUS_SIZE bytes. The rest is to be ignored,
+unless read back data follows (see READ BACK).
+The status is filled in when the transaction is queued, i.e. up to MAX_SPI_MESSAGES transactions before the master reads it.
 
+BATCH FORMAT:
+
+The body of a BATCH packet is a sequence of commands, executed in order. Each command has the same 4 byte header as a
+packet (command byte, length LSB, length MSB, stream ID) followed by its body. The next command starts at the next
+multiple of 4 bytes after the body, so write data stays word alligned. Pad with anything.
+
+|  Header 1  |  Body 1  |  Pad to 4  |  Header 2  |  Body 2  |  Pad to 4  | ...
+
+Any command except BATCH can be used. A WRITEFILE inside a batch carries all its data in the batch.
+A batch must fit in one packet, so one packet can rotate files and carry the first data.
+
+READ BACK:
+
+READ_OPEN opens a file for reading (body: path, stream ID ignored). A reader task prefetches the file in blocks of
+SPI_BLOCK_SIZE, and every transaction queued while a block is ready carries it on MISO right after the status:
+
+|  spi_status_t (read != 0)  |  spi_read_header_t  |  len bytes of file data  |
+
+The master keeps clocking transactions of SPI_READ_PKT_SIZE bytes, READ_BLOCK with empty body, and collects the blocks
+in offset order until a header with SPI_READ_EOF (or SPI_READ_ERROR). Blocks are ready up to MAX_SPI_MESSAGES
+transactions before they are clocked out, so a block may arrive in the transaction of a previous command.
+READ_BLOCK with a 4 byte body continues reading from that offset, to fetch blocks again after an error.
+Blocks of an earlier READ_OPEN have another file_id and are to be ignored.
+
+FLOW CONTROL:
+
+The handshake line is high while a transaction is ready. credits in the status reply tells how many packets the master
+can send back to back before it has to wait for the SD writer, so bursts can be sized to the available buffering.
 */
 
 typedef enum eControl { 
@@ -56,10 +134,76 @@ typedef enum eControl {
     SYNCFILE = 0x08, 
     SLEEP = 0x10, 
     WAKEUP = 0x20, 
-    MAKEDIR = 0x40
+    MAKEDIR = 0x40,
+    OPEN_FILE_EX = 0x03,        /* OPEN_FILE with options. Body: spi_open_ex_t followed by the path */
+    SET_QUEUE_DEPTH = 0x05,     /* Number of SPI transactions to keep queued. Body: 1 byte, 1 - MAX_SPI_MESSAGES */
+    BATCH = 0x06,               /* Several commands in one packet, see BATCH FORMAT */
+    READ_OPEN = 0x07,           /* Open a file for read back on MISO, see READ BACK. Body: path */
+    READ_BLOCK = 0x09           /* Clock out read back data. Body: empty, or uint32_t offset to continue reading from */
 
 }eControl;
 
+/* Header size of each command inside a BATCH */
+#define SPI_BATCH_HEADER_SIZE   4
+
+/* Body of OPEN_FILE_EX, little endian. The path follows directly after, length in header is sizeof(spi_open_ex_t) + path length */
+typedef struct __attribute__((packed)) spi_open_ex {
+    uint32_t size_hint;         /* Expected size of the file in bytes. Clusters are preallocated up to this size and
+                                   the file is trimmed to the written size when closed. 0 = no preallocation */
+    uint8_t flags;              /* SPI_OPEN_xxx flags, other bits reserved, send 0 */
+    uint8_t reserved[3];
+} spi_open_ex_t;
+
+/* OPEN_FILE_EX flags */
+#define SPI_OPEN_COMPRESS   0x01    /* Store written data LZ4 compressed (LZ4 frame format, 4 KB independent blocks).
+                                       Name the file *.lz4, the web interface can then download it decompressed */
+#define SPI_OPEN_ROTATE     0x02    /* Split the file in segments "path.0001", "path.0002", ... after SPI_ROTATE_BYTES or
+                                       SPI_ROTATE_SECONDS (menuconfig). Numbering continues after the last segment on the card */
+#define SPI_OPEN_TIMESTAMP  0x08    /* Write the data of each WRITEFILE packet as a record with its receive time
+                                       (sd_record_header_t) and keep a time index beside the file, so the web
+                                       interface can serve time ranges. See sd_writer.h */
+#define SPI_OPEN_MKDIR      0x04    /* Create missing parent folders of the path (mkdir -p), so no MAKEDIR is needed first.
+                                       Plain OPEN_FILE does this too when SPI_OPEN_MKDIR is set in menuconfig */
+
+/* Status reply sent to the master on MISO, little endian */
+#define SPI_STATUS_SIZE     20
+#define SPI_STATUS_MAGIC    0xA5
+
+typedef struct __attribute__((packed)) spi_status {
+    uint8_t magic;              /* SPI_STATUS_MAGIC, anything else means the status is not valid */
+    uint8_t queued;             /* SPI transactions queued in the driver */
+    uint8_t free_buffers;       /* Receive buffers free in the pool */
+    uint8_t backlog;            /* Received packets waiting for the SD writer */
+    uint32_t last_seq;          /* Sequence number of the last accepted packet (protocol v2) */
+    uint32_t backlog_bytes;     /* Received bytes waiting for the SD writer */
+    uint16_t crc_errors;        /* Packets dropped due to wrong CRC or length (protocol v2) */
+    uint16_t seq_errors;        /* Packets dropped due to unexpected sequence number (protocol v2) */
+    uint8_t credits;            /* Packets the master can send now without waiting for the SD writer */
+    uint8_t queue_depth;        /* Number of transactions the slave keeps queued */
+    uint8_t read;               /* Non zero if a spi_read_header_t and read back data follow the status */
+    uint8_t reserved;
+} spi_status_t;
+
+/* Read back data header on MISO, little endian */
+#define SPI_READ_HEADER_SIZE    8
+#define SPI_READ_EOF            0x01        /* Last block of the file */
+#define SPI_READ_ERROR          0x02        /* File could not be opened or read. No data */
+
+typedef struct __attribute__((packed)) spi_read_header {
+    uint32_t offset;            /* File offset of the data */
+    uint16_t len;               /* Bytes of file data following the header, up to SPI_BLOCK_SIZE */
+    uint8_t flags;              /* SPI_READ_xxx */
+    uint8_t file_id;            /* Incremented on every READ_OPEN */
+} spi_read_header_t;
+
+/* A received SPI packet. Buffers are owned by the pool in spi.c and handed to the SD writer task */
+typedef struct spi_buffer {
+    char *data;                 /* DMA capable, word alligned buffer of SPI_TRANS_SIZE bytes */
+    uint16_t len;               /* Number of bytes received */
+    uint8_t backlog;            /* Packets waiting for the SD writer when this one was received */
+    int64_t time;               /* Receive time, micro seconds since boot */
+} spi_buffer_t;
+
 
 /*  Init and install SPI driver                */
 void init_esp32_spi_slave();
@@ -67,6 +211,20 @@ void init_esp32_spi_slave();
 /*  Main task of SPI Slave receive */
 void SPI_task (void *arg);
 
+/*  Get next received packet in the order it was received. Only to be called from the SD writer task.
+ *  Returns NULL if nothing was received within ticks_to_wait */
+spi_buffer_t *spi_get_received(TickType_t ticks_to_wait);
+
+/*  Set the number of SPI transactions to keep queued (1 - MAX_SPI_MESSAGES). Returns false if out of range */
+bool spi_set_queue_depth(int depth);
+
+/*  Return a packet buffer to the pool so it can be queued for a new SPI transaction */
+void spi_release_buffer(spi_buffer_t *buf);
+
+/*  Save queue depth and last sequence number in RTC memory before deep sleep. They are restored when the
+ *  SPI task starts after a deep sleep wake up, so the master can continue where it left off */
+void spi_save_state(void);
+
 
 #ifdef __cplusplus
 }
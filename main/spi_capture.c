@@ -0,0 +1,92 @@
+/*  SPI packet capture.
+ *
+ *  Records the packets received by the SPI task as they are taken by the SD writer, with receive time and
+ *  backlog, so a real workload can be replayed on a PC. Writing the capture costs card bandwidth,
+ *  so it is only enabled with CONFIG_SPI_CAPTURE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "sdmmc.h"
+#include "spi.h"
+#include "spi_capture.h"
+
+
+static FILE *fd = NULL;
+static bool failed = false;             // Open failed, not tried again until the file is closed
+static bool boot_recorded = false;      // SPI_CAPTURE_BOOT record written since boot
+
+
+static bool capture_open(void)
+{
+    const char *path = SD_MOUNT "/" SPI_CAPTURE_FILE;
+    spi_capture_header_t header = {
+        .magic = SPI_CAPTURE_MAGIC,
+        .version = SPI_CAPTURE_VERSION,
+        .header_size = SPI_HEADER_SIZE,
+        .block_size = SPI_BLOCK_SIZE,
+        .pool_size = SPI_POOL_SIZE,
+    };
+
+    // Continue the file only if it was made with the same packet format
+    spi_capture_header_t old;
+    FILE *f = fopen(path, "rb");
+    bool append = f != NULL && fread(&old, sizeof(old), 1, f) == 1 && memcmp(&old, &header, sizeof(header)) == 0;
+    if (f != NULL) {
+        fclose(f);
+    }
+
+    fd = fopen(path, append ? "ab" : "wb");
+    if (fd == NULL) {
+        printf("Cannot open capture file %s\n", path);
+        failed = true;
+        return false;
+    }
+    setvbuf(fd, NULL, _IOFBF, SPI_BLOCK_SIZE);
+
+    if (!append) {
+        fwrite(&header, sizeof(header), 1, fd);
+    }
+    if (!boot_recorded) {
+        spi_capture_record_t boot = {
+            .type = SPI_CAPTURE_BOOT,
+        };
+        fwrite(&boot, sizeof(boot), 1, fd);
+        boot_recorded = true;
+    }
+    printf("SPI capture %s to %s\n", append ? "appended" : "started", path);
+    return true;
+}
+
+void spi_capture_packet(const spi_buffer_t *buf)
+{
+    if (fd == NULL && (failed || !capture_open())) {
+        return;
+    }
+
+    spi_capture_record_t record = {
+        .time = buf->time,
+        .len = buf->len,
+        .backlog = buf->backlog,
+        .type = SPI_CAPTURE_PACKET,
+    };
+    if (fwrite(&record, sizeof(record), 1, fd) != 1 || fwrite(buf->data, 1, buf->len, fd) != buf->len) {
+        printf("Capture write failed, capture stopped until next idle\n");
+        fclose(fd);
+        fd = NULL;
+        failed = true;
+    }
+}
+
+void spi_capture_close(void)
+{
+    if (fd != NULL) {
+        fclose(fd);
+        fd = NULL;
+    }
+    failed = false;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#ifndef SPI_CAPTURE_H_INCLUDED
+#define SPI_CAPTURE_H_INCLUDED
+
+#include <stdint.h>
+#include "spi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*  Capture of received SPI packets (CONFIG_SPI_CAPTURE).
+ *  Every packet the SD writer takes is appended to the capture file with its receive time, before it is executed.
+ *  The capture can be replayed on a PC with tools/spi_replay, to benchmark the SD writer without the board.
+ *
+ *  File format, little endian: spi_capture_header_t, then one spi_capture_record_t per record.
+ *  A SPI_CAPTURE_PACKET record is followed by the len bytes received, header included.
+ *  The file is appended to after each boot, starting with a SPI_CAPTURE_BOOT record. It is started again if it
+ *  was made by firmware with another packet format.
+ */
+
+#define SPI_CAPTURE_FILE        "spi_capture.bin"       /* In the root folder of the card */
+#define SPI_CAPTURE_MAGIC       0x43495053              /* "SPIC" */
+#define SPI_CAPTURE_VERSION     1
+
+typedef struct __attribute__((packed)) spi_capture_header {
+    uint32_t magic;             /* SPI_CAPTURE_MAGIC */
+    uint16_t version;           /* SPI_CAPTURE_VERSION */
+    uint16_t header_size;       /* SPI_HEADER_SIZE of the firmware, 12 for protocol v2 */
+    uint16_t block_size;        /* SPI_BLOCK_SIZE */
+    uint8_t pool_size;          /* SPI_POOL_SIZE */
+    uint8_t reserved;
+} spi_capture_header_t;
+
+/* Record types */
+#define SPI_CAPTURE_PACKET      0       /* A received packet */
+#define SPI_CAPTURE_BOOT        1       /* The device booted, time starts from 0 again. No data */
+
+typedef struct __attribute__((packed)) spi_capture_record {
+    uint64_t time;              /* Receive time, micro seconds since boot */
+    uint16_t len;               /* Bytes of packet data following the record */
+    uint8_t backlog;            /* Packets waiting for the SD writer when this one was received */
+    uint8_t type;               /* SPI_CAPTURE_xxx */
+} spi_capture_record_t;
+
+
+/*  Append a received packet to the capture file. Opens the file on first use. Called from the SD writer task */
+void spi_capture_packet(const spi_buffer_t *buf);
+
+/*  Close the capture file, so it can be downloaded. It is opened again on the next packet */
+void spi_capture_close(void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* SPI_CAPTURE_H_INCLUDED */
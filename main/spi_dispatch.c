@@ -0,0 +1,189 @@
+/*  SPI command dispatcher.
+ *
+ *  Command bytes index a 256 byte table of slots, so finding the handler is one load whatever the number of
+ *  commands. Follow-on packets of a multi packet command skip the lookup, they go straight to the handler of the
+ *  command in progress.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <sys/param.h>
+#include "esp_timer.h"
+
+#include "spi.h"
+#include "spi_dispatch.h"
+
+
+typedef struct command_entry {
+    spi_command_handler_t handler;
+    uint8_t code;
+    uint8_t flags;
+    uint32_t calls;             // Handler calls since boot, one per part of a multi packet command
+    uint32_t calls_logged;      // Calls at last log
+    uint32_t max_us;            // Longest call
+    int64_t us;                 // Time spent in the handler
+} command_entry_t;
+
+static void execute_batch(const spi_command_t *cmd);
+
+// Slot in entries + 1 of each command byte, 0 if not registered. BATCH is built in.
+static uint8_t slots[256] = { [BATCH] = 1 };
+static command_entry_t entries[SPI_MAX_COMMANDS] = {
+    { .handler = execute_batch, .code = BATCH, .flags = SPI_CMD_NO_BATCH },
+};
+static int entry_count = 1;
+
+/* Multi packet command in progress */
+static command_entry_t *follow = NULL;      // Handler of the following packets, NULL if they are skipped
+static spi_command_t follow_cmd;            // Last part given to the handler
+static size_t follow_remaining = 0;         // Bytes of the body still to come
+
+
+bool spi_register_command(uint8_t code, spi_command_handler_t handler, uint8_t flags)
+{
+    command_entry_t *entry;
+
+    if (slots[code] != 0) {
+        entry = &entries[slots[code] - 1];
+    } else if (entry_count < SPI_MAX_COMMANDS) {
+        entry = &entries[entry_count++];
+        slots[code] = entry_count;
+    } else {
+        printf("Cannot register SPI command 0x%X, table full\n", code);
+        return false;
+    }
+    entry->handler = handler;
+    entry->code = code;
+    entry->flags = flags;
+    return true;
+}
+
+static void call_handler(command_entry_t *entry, const spi_command_t *cmd)
+{
+    int64_t start = esp_timer_get_time();
+
+    entry->handler(cmd);
+
+    uint32_t us = esp_timer_get_time() - start;
+    entry->calls++;
+    entry->us += us;
+    entry->max_us = MAX(entry->max_us, us);
+}
+
+static void dispatch(uint8_t code, uint8_t stream_id, char *data, uint16_t length, bool in_batch, int64_t time)
+{
+    command_entry_t *entry = slots[code] != 0 ? &entries[slots[code] - 1] : NULL;
+    bool multi_packet = !in_batch && length > SPI_BLOCK_SIZE && entry != NULL && (entry->flags & SPI_CMD_FOLLOW_ON);
+
+    if (stream_id >= SPI_MAX_STREAMS) {
+        printf("Invalid stream ID: %i  (command byte: 0x%X)\n", stream_id, code);
+        // Skip the following packets of the command, so they are not taken as commands.
+        if (multi_packet) {
+            follow = NULL;
+            follow_remaining = length - SPI_BLOCK_SIZE;
+        }
+        return;
+    }
+    if (entry == NULL) {
+        printf("UNKNOWN COMMAND byte: 0x%X     -  length: %i\n", code, length);
+        return;
+    }
+    if (in_batch && (entry->flags & SPI_CMD_NO_BATCH)) {
+        printf("COMMAND 0x%X: Not allowed in a batch\n", code);
+        return;
+    }
+    if (!in_batch && length > SPI_BLOCK_SIZE && !multi_packet) {
+        printf("COMMAND 0x%X: Invalid length: %i\n", code, length);
+        return;
+    }
+
+    spi_command_t cmd = {
+        .code = code,
+        .stream_id = stream_id,
+        .length = length,
+        .offset = 0,
+        .data = data,
+        .len = multi_packet ? SPI_BLOCK_SIZE : length,
+        .in_batch = in_batch,
+        .time = time,
+    };
+    if (multi_packet) {
+        follow = entry;
+        follow_cmd = cmd;
+        follow_remaining = length - SPI_BLOCK_SIZE;
+    }
+    call_handler(entry, &cmd);
+}
+
+/* Execute the commands of a BATCH container in order. Each command has the same 4 byte header as a SPI packet,
+ * and the next command starts at the next 4 byte boundary after its body. */
+static void execute_batch(const spi_command_t *cmd)
+{
+    size_t pos = 0;
+    int count = 0;
+
+    while (pos + SPI_BATCH_HEADER_SIZE <= cmd->length) {
+        uint8_t *item = (uint8_t *)cmd->data + pos;
+        uint16_t item_len = (item[2] << 8) | item[1];
+
+        if (pos + SPI_BATCH_HEADER_SIZE + item_len > cmd->length) {
+            printf("BATCH COMMAND: Command %i (0x%X) does not fit in batch, %i bytes left\n", count, item[0], cmd->length - pos);
+            break;
+        }
+        dispatch(item[0], item[3], (char *)item + SPI_BATCH_HEADER_SIZE, item_len, true, cmd->time);
+
+        pos += SPI_BATCH_HEADER_SIZE + ((item_len + 3) & ~3);
+        count++;
+    }
+    printf("BATCH COMMAND: %i commands\n", count);
+}
+
+void spi_dispatch_packet(spi_buffer_t *buf)
+{
+    char *currentBuffer = buf->data;
+
+    // Follow-on packet of a multi packet command. These carry data only, no header.
+    if (follow_remaining > 0) {
+        size_t len = MIN(SPI_BLOCK_SIZE, follow_remaining);
+        follow_remaining -= len;
+        if (follow != NULL) {
+            follow_cmd.offset += follow_cmd.len;
+            follow_cmd.data = currentBuffer;
+            follow_cmd.len = len;
+            follow_cmd.time = buf->time;
+            call_handler(follow, &follow_cmd);
+        }
+        return;
+    }
+
+    const uint8_t *header = (const uint8_t *)currentBuffer;                    // Unsigned, char is signed on some hosts
+    uint8_t msgCode = header[0];                                                // Command byte of SPI message
+    uint16_t length = (header[2] << 8) | header[1];                             // Length of SPI message
+    uint8_t stream_id = header[3];                                              // Stream the command applies to
+    char * spi_data = currentBuffer + SPI_HEADER_SIZE;                          // Body of SPI message
+
+    dispatch(msgCode, stream_id, spi_data, length, false, buf->time);
+}
+
+size_t spi_dispatch_reset(void)
+{
+    size_t missing = follow != NULL ? follow_remaining : 0;
+
+    follow = NULL;
+    follow_remaining = 0;
+    return missing;
+}
+
+void spi_dispatch_log_stats(void)
+{
+    for (int i = 0; i < entry_count; i++) {
+        command_entry_t *entry = &entries[i];
+        if (entry->calls != entry->calls_logged) {
+            entry->calls_logged = entry->calls;
+            printf("SPI command 0x%02X: %u calls, average %lli us, max %u us since boot\n", entry->code,
+                    entry->calls, entry->us / entry->calls, entry->max_us);
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+#ifndef SPI_DISPATCH_H_INCLUDED
+#define SPI_DISPATCH_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "spi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*  SPI command dispatcher.
+ *  Commands are looked up by command byte in a table filled in with spi_register_command(). The dispatcher checks
+ *  the header, follows multi packet commands and BATCH containers, and times every handler call the same way.
+ *  Packets are dispatched in the SD writer task, which gives the buffer back to the pool afterwards.
+ */
+
+/* Maximum number of registered commands */
+#define SPI_MAX_COMMANDS        24
+
+/* Command flags */
+#define SPI_CMD_FOLLOW_ON       0x01    /* The body may be longer than SPI_BLOCK_SIZE. The rest arrives in the following
+                                           packets, without header, and the handler is called once for each part */
+#define SPI_CMD_NO_BATCH        0x02    /* Not allowed inside a BATCH */
+
+/* One part of a command body. A command without SPI_CMD_FOLLOW_ON always has one part */
+typedef struct spi_command {
+    uint8_t code;               /* Command byte */
+    uint8_t stream_id;          /* Stream ID, checked to be below SPI_MAX_STREAMS */
+    uint16_t length;            /* Length of the whole body, from the header */
+    uint32_t offset;            /* Offset of this part in the body. 0 for the part in the header packet */
+    char *data;                 /* This part of the body. Only valid during the call */
+    uint16_t len;               /* Bytes in this part. The last part ends at length */
+    bool in_batch;              /* Command is inside a BATCH container */
+    int64_t time;               /* Receive time of the packet with this part, micro seconds since boot */
+} spi_command_t;
+
+typedef void (*spi_command_handler_t)(const spi_command_t *cmd);
+
+
+/*  Register the handler of a command byte, or replace it. BATCH is handled by the dispatcher.
+ *  To be called before the SPI task is started, or from the SD writer task.
+ *  Returns false if the table is full */
+bool spi_register_command(uint8_t code, spi_command_handler_t handler, uint8_t flags);
+
+/*  Execute one received packet. Called from the SD writer task */
+void spi_dispatch_packet(spi_buffer_t *buf);
+
+/*  Give up a multi packet command that is waiting for more packets. Returns the number of bytes missing */
+size_t spi_dispatch_reset(void);
+
+/*  Print number of calls and handler time since boot of the commands used since last time */
+void spi_dispatch_log_stats(void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* SPI_DISPATCH_H_INCLUDED */
@@ -0,0 +1,249 @@
+/*  SPI read back.
+ *
+ *  Reads a file from the sd card ahead of the master. Blocks circulate between this task and the SPI task:
+ *  free ring -> reader (file data read in) -> ready ring -> queued SPI transaction (tx buffer) -> free ring.
+ *  The SPI task never waits for the card, it attaches a block to a transaction only if one is ready.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include "spi.h"
+#include "spsc_ring.h"
+#include "spi_reader.h"
+
+
+static const char *TAG = "SPI_reader";
+
+typedef enum {
+    REQ_OPEN,
+    REQ_SEEK,
+    REQ_CLOSE
+} read_request_type_t;
+
+/* Request from the SD writer task, or from shutdown for REQ_CLOSE */
+typedef struct read_request {
+    read_request_type_t type;
+    char *path;                 // REQ_OPEN
+    uint32_t offset;            // REQ_SEEK
+} read_request_t;
+
+typedef enum {
+    READER_IDLE,                // No file, or the whole file is sent
+    READER_READING,             // Reading blocks while there are free buffers
+    READER_FAILED               // Open or read failed, an error block is to be sent
+} reader_state_t;
+
+static spsc_ring_t free_blocks;         // Producer: SPI task.     Consumer: reader task
+static spsc_ring_t ready_blocks;        // Producer: reader task.  Consumer: SPI task
+static atomic_bool started;             // Set when rings and blocks are allocated
+
+static TaskHandle_t reader_handle = NULL;
+static QueueHandle_t requests = NULL;
+
+static SemaphoreHandle_t closed = NULL;         // Given by the reader task when a REQ_CLOSE is done
+
+static FILE *fd = NULL;                 // Closed at the end of the file, and opened again by a seek
+static char *path = NULL;               // Of the last file opened
+static uint32_t offset = 0;             // File offset of the next block
+static uint8_t file_id = 0;
+static reader_state_t state = READER_IDLE;
+
+
+static void close_file(void)
+{
+    if (fd != NULL) {
+        fclose(fd);
+        fd = NULL;
+    }
+}
+
+static void handle_request(read_request_t *req)
+{
+    switch (req->type) {
+    case REQ_SEEK:
+        // The file is closed when it has been read to the end, a seek back opens it again
+        if (fd == NULL && path != NULL) {
+            fd = fopen(path, "rb");
+        }
+        if (fd != NULL && fseek(fd, req->offset, SEEK_SET) == 0) {
+            offset = req->offset;
+            state = READER_READING;
+        } else {
+            state = READER_FAILED;
+        }
+        break;
+
+    case REQ_OPEN:
+        close_file();
+        free(path);
+        path = req->path;
+        file_id++;
+        offset = 0;
+        fd = fopen(path, "rb");
+        if (fd == NULL) {
+            printf("READ OPEN COMMAND: Cannot open file %s\n", path);
+            state = READER_FAILED;
+        } else {
+            printf("READ OPEN COMMAND: %s\n", path);
+            state = READER_READING;
+        }
+        break;
+
+    case REQ_CLOSE:
+        close_file();
+        free(path);
+        path = NULL;
+        state = READER_IDLE;
+        xSemaphoreGive(closed);
+        break;
+    }
+}
+
+/* Read the next block of the file into a free buffer, or fill in an error block */
+static void read_block(uint8_t *block)
+{
+    spi_read_header_t header = {
+        .offset = offset,
+        .file_id = file_id,
+    };
+
+    if (state == READER_READING) {
+        size_t n = fread(block + SPI_STATUS_SIZE + SPI_READ_HEADER_SIZE, 1, SPI_BLOCK_SIZE, fd);
+        header.len = n;
+        offset += n;
+        if (n < SPI_BLOCK_SIZE) {
+            header.flags = ferror(fd) ? SPI_READ_ERROR : SPI_READ_EOF;
+            state = READER_IDLE;
+            close_file();
+        }
+    } else {
+        header.flags = SPI_READ_ERROR;
+        state = READER_IDLE;
+    }
+    memcpy(block + SPI_STATUS_SIZE, &header, sizeof(header));
+
+    // Ring is larger than the number of blocks, so it can not be full
+    spsc_ring_push(&ready_blocks, block);
+}
+
+static void reader_task(void *arg)
+{
+    read_request_t req;
+    uint8_t *block;
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (xQueueReceive(requests, &req, 0) == pdTRUE) {
+            handle_request(&req);
+        }
+        while (state != READER_IDLE && (block = spsc_ring_pop(&free_blocks)) != NULL) {
+            read_block(block);
+        }
+    }
+}
+
+// A ring of 4 holds 3 blocks, so pushing a block back can never fail
+_Static_assert(SPI_READ_BUFFERS <= 3, "Read rings too small");
+
+static bool reader_start(void)
+{
+    if (!spsc_ring_init(&free_blocks, 4) || !spsc_ring_init(&ready_blocks, 4)) {
+        ESP_LOGE(TAG, "Failed to allocate read rings");
+        return false;
+    }
+    for (int k = 0; k < SPI_READ_BUFFERS; k++) {
+        // Sent straight from this buffer by DMA
+        uint8_t *block = (uint8_t *)heap_caps_calloc(1, SPI_TRANS_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_32BIT);
+        if (block == NULL) {
+            ESP_LOGE(TAG, "Failed to allocate read buffer %i", k);
+            continue;
+        }
+        spsc_ring_push(&free_blocks, block);
+    }
+
+    requests = xQueueCreate(4, sizeof(read_request_t));
+    closed = xSemaphoreCreateBinary();
+    if (requests == NULL || closed == NULL || xTaskCreate(reader_task, "SPI_reader", 1024*3, NULL, SPI_READER_PRIORITY, &reader_handle) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start reader task");
+        return false;
+    }
+    atomic_store(&started, true);
+    return true;
+}
+
+static void send_request(read_request_t *req)
+{
+    if (!atomic_load(&started) && !reader_start()) {
+        free(req->path);
+        return;
+    }
+    if (xQueueSend(requests, req, portMAX_DELAY) != pdTRUE) {
+        free(req->path);
+        return;
+    }
+    xTaskNotifyGive(reader_handle);
+}
+
+void spi_reader_open(const char *path)
+{
+    read_request_t req = {
+        .type = REQ_OPEN,
+        .path = strdup(path),
+    };
+    if (req.path == NULL) {
+        printf("READ OPEN COMMAND: Cannot allocate path\n");
+        return;
+    }
+    send_request(&req);
+}
+
+void spi_reader_seek(uint32_t offset)
+{
+    read_request_t req = {
+        .type = REQ_SEEK,
+        .offset = offset,
+    };
+    send_request(&req);
+}
+
+bool spi_reader_close(uint32_t timeout_ms)
+{
+    if (!atomic_load(&started)) {
+        return true;
+    }
+    read_request_t req = {
+        .type = REQ_CLOSE,
+    };
+    xSemaphoreTake(closed, 0);
+    if (xQueueSend(requests, &req, timeout_ms / portTICK_PERIOD_MS) != pdTRUE) {
+        return false;
+    }
+    xTaskNotifyGive(reader_handle);
+    return xSemaphoreTake(closed, timeout_ms / portTICK_PERIOD_MS) == pdTRUE;
+}
+
+uint8_t *spi_reader_get_block(void)
+{
+    if (!atomic_load(&started)) {
+        return NULL;
+    }
+    return spsc_ring_pop(&ready_blocks);
+}
+
+void spi_reader_release_block(uint8_t *block)
+{
+    spsc_ring_push(&free_blocks, block);
+    xTaskNotifyGive(reader_handle);
+}
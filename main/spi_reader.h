@@ -0,0 +1,40 @@
+#pragma once
+#ifndef SPI_READER_H_INCLUDED
+#define SPI_READER_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Number of read back blocks prefetched ahead of the master. Allocated memmory: SPI_READ_BUFFERS * SPI_TRANS_SIZE */
+#define SPI_READ_BUFFERS        3
+
+#define SPI_READER_PRIORITY     10
+
+
+/*  Open a file for read back on MISO. Starts the reader task on first use. Called from the SD writer task */
+void spi_reader_open(const char *path);
+
+/*  Continue reading the open file from offset. Called from the SD writer task */
+void spi_reader_seek(uint32_t offset);
+
+/*  Close the read back file before the card is unmounted, waiting up to timeout_ms for the reader task.
+ *  The file is also closed when it has been read to the end. Returns true if no file is open */
+bool spi_reader_close(uint32_t timeout_ms);
+
+/*  Get the next prefetched block, NULL if none is ready. The block starts with room for the status,
+ *  followed by the read header and data. Only to be called from the SPI task */
+uint8_t *spi_reader_get_block(void);
+
+/*  Give a block back to the reader after it has been clocked out. Only to be called from the SPI task */
+void spi_reader_release_block(uint8_t *block);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* SPI_READER_H_INCLUDED */
@@ -0,0 +1,70 @@
+/*  Lock-free single producer / single consumer ring.
+ *
+ *  Used to hand buffers between the SPI receive task and the SD writer task.
+ *  Indexes are free running and masked on access, the producer only writes head
+ *  and the consumer only writes tail, so no lock is needed between the two cores.
+ */
+
+#include <stdlib.h>
+
+#include "spsc_ring.h"
+
+
+bool spsc_ring_init(spsc_ring_t *ring, size_t size)
+{
+    if (size < 2 || (size & (size - 1)) != 0) {
+        return false;
+    }
+
+    ring->slots = (void **)calloc(size, sizeof(void *));
+    if (ring->slots == NULL) {
+        return false;
+    }
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return true;
+}
+
+void spsc_ring_free(spsc_ring_t *ring)
+{
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+bool spsc_ring_push(spsc_ring_t *ring, void *item)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail >= ring->mask) {
+        return false;       // full
+    }
+
+    ring->slots[head & ring->mask] = item;
+    // publish the slot before the new head becomes visible to the consumer
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+void *spsc_ring_pop(spsc_ring_t *ring)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail) {
+        return NULL;        // empty
+    }
+
+    void *item = ring->slots[tail & ring->mask];
+    // release the slot back to the producer
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return item;
+}
+
+size_t spsc_ring_count(spsc_ring_t *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return head - tail;
+}
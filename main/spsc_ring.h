@@ -0,0 +1,42 @@
+#pragma once
+#ifndef SPSC_RING_H_INCLUDED
+#define SPSC_RING_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Lock-free single producer / single consumer ring of pointers.
+ * One task (or ISR) may push and one other task may pop without any locking.
+ * Size must be a power of two. The ring can hold size - 1 elements. */
+typedef struct spsc_ring {
+    void **slots;
+    size_t mask;
+    atomic_size_t head;         /* written by producer only */
+    atomic_size_t tail;         /* written by consumer only */
+} spsc_ring_t;
+
+/* Allocate ring storage. Returns false if size is not a power of two or allocation failed */
+bool spsc_ring_init(spsc_ring_t *ring, size_t size);
+
+/* Free ring storage */
+void spsc_ring_free(spsc_ring_t *ring);
+
+/* Push an element. Returns false if the ring is full. Producer side only */
+bool spsc_ring_push(spsc_ring_t *ring, void *item);
+
+/* Pop an element. Returns NULL if the ring is empty. Consumer side only */
+void *spsc_ring_pop(spsc_ring_t *ring);
+
+/* Number of elements currently in the ring. Safe to call from any task */
+size_t spsc_ring_count(spsc_ring_t *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* SPSC_RING_H_INCLUDED */
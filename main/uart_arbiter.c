@@ -0,0 +1,379 @@
+/*  Arbiter of the sensor uart.
+ *
+ *  uart_lock is held by the bridge for each read or write, and by the arbiter task for a whole transaction.
+ *  Callers of uart_arbiter_transact() post the transaction to the arbiter task and wait on a semaphore, so
+ *  transactions run one at a time in the order they were asked for.
+ *  A request is on the heap, so a caller that gives up waiting can leave it in the queue: if the arbiter task has
+ *  not started it, the caller marks it cancelled and the arbiter task frees it. One that has started is waited for,
+ *  as it uses the caller's transaction, and it ends within its own timeouts.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <stdatomic.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "driver/uart.h"
+
+#include "uart_tcp_server.h"
+#include "uart_arbiter.h"
+
+
+enum request_state {
+    REQUEST_QUEUED,
+    REQUEST_RUNNING,
+    REQUEST_CANCELLED,          /* The caller gave up before it ran */
+};
+
+typedef struct arbiter_request {
+    uart_transaction_t *t;      /* NULL for a baud rate change */
+    uint32_t baud;
+    esp_err_t result;
+    SemaphoreHandle_t done;     /* NULL if nobody waits, then the arbiter task frees it when done */
+    atomic_int state;
+} arbiter_request_t;
+
+static const char *TAG = "UART_arbiter";
+
+static SemaphoreHandle_t uart_lock = NULL;
+static QueueHandle_t requests = NULL;
+static atomic_bool passthrough = false;        // Set by the bridge task
+static bool line_open = false;                  // The bridge has sent part of a line to the sensor. Under uart_lock
+static atomic_uint baud_rate = UART_BAUD_DEFAULT;   // Written by the arbiter task
+static atomic_uint discarded = 0;               // Sensor output the bridge did not read in time
+
+
+// Take the uart after the bridge is done with it: the last line to the sensor is complete, and all it has sent is
+// read. Gives up waiting after UART_ARBITER_QUIET_MS, then the sensor may get a mixed line, and what the bridge has
+// not read is discarded and counted.
+static void take_uart(void)
+{
+    int64_t deadline = esp_timer_get_time() + UART_ARBITER_QUIET_MS * 1000LL;
+    size_t buffered;
+
+    while (1) {
+        xSemaphoreTake(uart_lock, portMAX_DELAY);
+        buffered = 0;
+        uart_get_buffered_data_len(EX_UART_NUM, &buffered);
+        if (!atomic_load(&passthrough) || (!line_open && buffered == 0) || esp_timer_get_time() >= deadline) {
+            break;
+        }
+        xSemaphoreGive(uart_lock);
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+    }
+
+    // Nobody to give it to, or the bridge did not take it in time
+    if (atomic_load(&passthrough) && buffered > 0) {
+        atomic_fetch_add(&discarded, buffered);
+        ESP_LOGW(TAG, "%u bytes from the sensor not read by the bridge in %u ms, discarded", buffered, UART_ARBITER_QUIET_MS);
+    }
+    uart_flush_input(EX_UART_NUM);
+}
+
+// Find needle in haystack[from:len], case insensitive. Returns offset or -1
+static int find(const char *haystack, size_t len, size_t from, const char *needle)
+{
+    size_t n = strlen(needle);
+    for (size_t i = from; i + n <= len; i++) {
+        if (strncasecmp(haystack + i, needle, n) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Wait up to ticks for data, then read what has arrived, up to size
+static int read_some(char *buf, size_t size, TickType_t ticks)
+{
+    int len = uart_read_bytes(EX_UART_NUM, buf, 1, ticks);
+    size_t buffered = 0;
+    uart_get_buffered_data_len(EX_UART_NUM, &buffered);
+    if (len == 1 && buffered > 0 && size > 1) {
+        int more = uart_read_bytes(EX_UART_NUM, buf + 1, MIN(buffered, size - 1), 0);
+        len += MAX(0, more);
+    }
+    return len;
+}
+
+static esp_err_t run(uart_transaction_t *t)
+{
+    size_t len = 0;             // Bytes in t->resp
+    int start = -1;
+    int64_t deadline = esp_timer_get_time() + t->timeout_ms * 1000LL;
+
+    take_uart();
+    uart_write_bytes(EX_UART_NUM, t->cmd, strlen(t->cmd));
+
+    while (1) {
+        int64_t left_us = deadline - esp_timer_get_time();
+        if (left_us <= 0) {
+            break;
+        }
+        int rxBytes = read_some(t->resp + len, t->resp_size - 1 - len, MAX(1, left_us / 1000 / portTICK_PERIOD_MS));
+        if (rxBytes <= 0) {
+            continue;
+        }
+        len += rxBytes;
+        t->resp[len] = '\0';
+
+        if (start < 0) {
+            start = find(t->resp, len, 0, t->start);
+            if (start < 0) {
+                // Keep the tail that can be the start of t->start
+                size_t keep = MIN(len, strlen(t->start) - 1);
+                memmove(t->resp, t->resp + len - keep, keep);
+                len = keep;
+                continue;
+            }
+            // Response from start
+            memmove(t->resp, t->resp + start, len - start);
+            len -= start;
+            start = 0;
+            t->resp[len] = '\0';
+        }
+
+        int end = find(t->resp, len, strlen(t->start), t->end);
+        if (end >= 0) {
+            // Anything after the end is not part of the response, and is lost
+            t->resp[end + strlen(t->end)] = '\0';
+            xSemaphoreGive(uart_lock);
+            return ESP_OK;
+        }
+        if (len == t->resp_size - 1) {
+            break;
+        }
+    }
+
+    t->resp[start < 0 ? 0 : len] = '\0';
+    xSemaphoreGive(uart_lock);
+    return ESP_ERR_TIMEOUT;
+}
+
+// Send the baud rate command to the sensor, and switch the uart when the sensor has switched
+static void switch_baud(uint32_t baud)
+{
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), UART_BAUD_COMMAND "\n", (unsigned)baud);
+
+    take_uart();
+    uart_write_bytes(EX_UART_NUM, cmd, strlen(cmd));
+    uart_wait_tx_done(EX_UART_NUM, 100 / portTICK_PERIOD_MS);
+    vTaskDelay(UART_BAUD_SETTLE_MS / portTICK_PERIOD_MS);
+    uart_set_speed(baud);
+    // The reply to the command, at the old rate, is garbage now
+    uart_flush_input(EX_UART_NUM);
+    xSemaphoreGive(uart_lock);
+}
+
+static esp_err_t run_baud(uint32_t baud)
+{
+    char resp[64];
+    uart_transaction_t probe = {
+        .cmd = "do_get clock\n",
+        .start = "#",
+        .end = "#",
+        .timeout_ms = UART_QUERY_TIMEOUT_MS,
+        .resp = resp,
+        .resp_size = sizeof(resp),
+    };
+    uint32_t old = atomic_load(&baud_rate);
+
+    if (baud == old) {
+        return ESP_OK;
+    }
+    switch_baud(baud);
+    if (run(&probe) == ESP_OK) {
+        atomic_store(&baud_rate, baud);
+        return ESP_OK;
+    }
+
+    // The sensor did not switch, or switched and did not answer. Told at the new rate, in case it switched
+    ESP_LOGW(TAG, "No answer at %u baud, back to %u", (unsigned)baud, (unsigned)old);
+    switch_baud(old);
+    return ESP_ERR_TIMEOUT;
+}
+
+static arbiter_request_t *new_request(uart_transaction_t *t, uint32_t baud, bool wait)
+{
+    arbiter_request_t *req = malloc(sizeof(arbiter_request_t));
+    if (req == NULL) {
+        return NULL;
+    }
+    req->t = t;
+    req->baud = baud;
+    req->result = ESP_FAIL;
+    req->done = NULL;
+    atomic_init(&req->state, REQUEST_QUEUED);
+    if (wait && (req->done = xSemaphoreCreateBinary()) == NULL) {
+        free(req);
+        return NULL;
+    }
+    return req;
+}
+
+static void free_request(arbiter_request_t *req)
+{
+    if (req->done != NULL) {
+        vSemaphoreDelete(req->done);
+    }
+    free(req);
+}
+
+static void arbiter_task(void *arg)
+{
+    arbiter_request_t *req;
+    while (1) {
+        if (xQueueReceive(requests, &req, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        int queued = REQUEST_QUEUED;
+        if (!atomic_compare_exchange_strong(&req->state, &queued, REQUEST_RUNNING)) {
+            free_request(req);
+            continue;
+        }
+        int64_t start = esp_timer_get_time();
+        if (req->t == NULL) {
+            req->result = run_baud(req->baud);
+            ESP_LOGI(TAG, "Baud rate %u %s in %lli ms", (unsigned)req->baud,
+                     req->result == ESP_OK ? "set" : "failed", (esp_timer_get_time() - start) / 1000);
+        } else {
+            req->result = run(req->t);
+            ESP_LOGD(TAG, "\"%.*s\" %s in %lli ms", (int)strcspn(req->t->cmd, "\r\n"), req->t->cmd,
+                     req->result == ESP_OK ? "done" : "timed out", (esp_timer_get_time() - start) / 1000);
+        }
+        if (req->done == NULL) {
+            free_request(req);
+        } else {
+            xSemaphoreGive(req->done);
+        }
+    }
+}
+
+void uart_arbiter_start(void)
+{
+    if (requests != NULL) {
+        return;
+    }
+
+    if (!uart_is_driver_installed(EX_UART_NUM)) {
+        uart_init();
+    }
+    uart_lock = xSemaphoreCreateMutex();
+    requests = xQueueCreate(UART_ARBITER_QUEUE_SIZE, sizeof(arbiter_request_t *));
+    xTaskCreate(arbiter_task, "uart_arbiter", 1024*3, NULL, UART_ARBITER_PRIORITY, NULL);
+}
+
+// Post a request to the arbiter task and wait for it. Gives up after wait ticks if the arbiter task has not
+// started it by then
+static esp_err_t post(uart_transaction_t *t, uint32_t baud, TickType_t wait)
+{
+    if (requests == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    arbiter_request_t *req = new_request(t, baud, true);
+    if (req == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    TimeOut_t timeout;
+    vTaskSetTimeOutState(&timeout);
+    if (xQueueSend(requests, &req, wait) != pdTRUE) {
+        free_request(req);
+        return ESP_ERR_TIMEOUT;
+    }
+    xTaskCheckForTimeOut(&timeout, &wait);
+    if (xSemaphoreTake(req->done, wait) != pdTRUE) {
+        int queued = REQUEST_QUEUED;
+        if (atomic_compare_exchange_strong(&req->state, &queued, REQUEST_CANCELLED)) {
+            return ESP_ERR_TIMEOUT;     // The arbiter task frees it
+        }
+        xSemaphoreTake(req->done, portMAX_DELAY);
+    }
+    esp_err_t result = req->result;
+    free_request(req);
+    return result;
+}
+
+esp_err_t uart_arbiter_transact(uart_transaction_t *t)
+{
+    if (t->resp_size < 2) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return post(t, 0, portMAX_DELAY);
+}
+
+esp_err_t uart_arbiter_set_baud(uint32_t baud, uint32_t timeout_ms)
+{
+    if (baud < UART_BAUD_MIN || baud > UART_BAUD_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return post(NULL, baud, timeout_ms / portTICK_PERIOD_MS);
+}
+
+esp_err_t uart_arbiter_set_baud_async(uint32_t baud)
+{
+    if (baud < UART_BAUD_MIN || baud > UART_BAUD_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (requests == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    arbiter_request_t *req = new_request(NULL, baud, false);
+    if (req == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (xQueueSend(requests, &req, 0) != pdTRUE) {
+        free_request(req);
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+uint32_t uart_arbiter_get_baud(void)
+{
+    return atomic_load(&baud_rate);
+}
+
+uint32_t uart_arbiter_discarded(void)
+{
+    return atomic_load(&discarded);
+}
+
+void uart_arbiter_set_passthrough(bool active)
+{
+    atomic_store(&passthrough, active);
+}
+
+int uart_arbiter_read(char *buf, size_t size)
+{
+    size_t buffered = 0;
+    int len = 0;
+
+    xSemaphoreTake(uart_lock, portMAX_DELAY);
+    uart_get_buffered_data_len(EX_UART_NUM, &buffered);
+    if (buffered > 0) {
+        len = uart_read_bytes(EX_UART_NUM, buf, MIN(buffered, size), 0);
+    }
+    xSemaphoreGive(uart_lock);
+    return len;
+}
+
+int uart_arbiter_write(const char *data, size_t len)
+{
+    xSemaphoreTake(uart_lock, portMAX_DELAY);
+    int written = uart_write_bytes(EX_UART_NUM, data, len);
+    if (len > 0) {
+        line_open = data[len - 1] != '\n' && data[len - 1] != '\r';
+    }
+    xSemaphoreGive(uart_lock);
+    return written;
+}
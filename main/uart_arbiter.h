@@ -0,0 +1,88 @@
+#pragma once
+#ifndef UART_ARBITER_H_INCLUDED
+#define UART_ARBITER_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*  Arbiter of the sensor uart (EX_UART_NUM).
+ *  The arbiter installs the driver once and keeps it. Two kinds of users share the uart:
+ *    - the passthrough stream of the TCP bridge, with uart_arbiter_read() and uart_arbiter_write()
+ *    - request/response transactions, like "do_get clock", run one at a time by the arbiter task
+ *  A transaction waits until the bridge has sent a whole line to the sensor and read what the sensor has sent, then
+ *  holds the uart until the response is complete or the timeout. The bridge waits meanwhile, so a transaction never
+ *  mixes with the stream. The wait for the bridge is at most UART_ARBITER_QUIET_MS: sensor output it has not read
+ *  by then is discarded, logged and counted in uart_arbiter_discarded(). The response is only given to the
+ *  transaction, the bridge clients don't see it.
+ *  A baud rate change runs as a transaction too: the sensor is told to switch, then the uart switches, and the
+ *  sensor must answer at the new rate, else both go back.
+ */
+
+/* Above the bridge task (12), so a transaction reads the response as it arrives and holds the uart as short as
+ * possible, while the bridge waits for uart_lock. Below the SD writer (15) and the SPI receiver (20), which must
+ * never wait for the sensor. */
+#define UART_ARBITER_PRIORITY       13
+#define UART_ARBITER_QUEUE_SIZE     4           /* Transactions waiting for the arbiter */
+#define UART_ARBITER_QUIET_MS       200         /* Max wait for the bridge to finish a line before a transaction */
+#define UART_BAUD_COMMAND           CONFIG_UART_BRIDGE_BAUD_COMMAND     /* Tells the sensor to switch, %u is the rate */
+#define UART_BAUD_SETTLE_MS         50          /* From the command is sent until the sensor has switched */
+#define UART_BAUD_WAIT_MS           2000        /* Max wait of the web page for a baud rate change to start */
+
+/* A request/response transaction */
+typedef struct uart_transaction {
+    const char *cmd;            /* Sent to the uart */
+    const char *start;          /* Response starts at the first occurence of this, case insensitive. Data before is discarded. Not empty */
+    const char *end;            /* Response is complete at the first occurence of this after start */
+    uint32_t timeout_ms;        /* From the command is sent until the response is complete */
+    char *resp;                 /* Response from start to end, both included, null terminated */
+    size_t resp_size;
+} uart_transaction_t;
+
+
+/*  Install the uart driver and start the arbiter task. Can be called more than once */
+void uart_arbiter_start(void);
+
+/*  Run a transaction and wait for it. Can be called from any task.
+ *  Returns ESP_OK with the response in t->resp, ESP_ERR_TIMEOUT if the response was not complete in time */
+esp_err_t uart_arbiter_transact(uart_transaction_t *t);
+
+/*  The bridge is (not) running. Without it, data the sensor sent on its own is discarded before a transaction */
+void uart_arbiter_set_passthrough(bool active);
+
+/*  Switch the sensor and the uart to baud, between UART_BAUD_MIN and UART_BAUD_MAX. Can be called from any task.
+ *  UART_BAUD_COMMAND is sent at the current rate, then the sensor is asked for its clock at the new rate.
+ *  Returns ESP_OK if it answered, else the sensor is told to go back and the uart goes back, and ESP_ERR_TIMEOUT.
+ *  Also ESP_ERR_TIMEOUT, with the rate unchanged, if the arbiter has not started the change in timeout_ms. A change
+ *  that has started is waited for, at most UART_BAUD_SETTLE_MS and two probes.
+ *  The TCP bridge goes back to UART_BAUD_DEFAULT when its last client disconnects */
+esp_err_t uart_arbiter_set_baud(uint32_t baud, uint32_t timeout_ms);
+
+/*  As uart_arbiter_set_baud(), without waiting: the change is queued for the arbiter task, and its result only
+ *  logged. Returns ESP_ERR_TIMEOUT if the queue is full */
+esp_err_t uart_arbiter_set_baud_async(uint32_t baud);
+
+/*  The baud rate the uart and the sensor are at */
+uint32_t uart_arbiter_get_baud(void);
+
+/*  Bytes of sensor output discarded before a transaction since boot, because the bridge did not read them in time */
+uint32_t uart_arbiter_discarded(void);
+
+/*  Passthrough: read what the uart has received, without waiting for more. Waits while a transaction runs.
+ *  Returns number of bytes read */
+int uart_arbiter_read(char *buf, size_t size);
+
+/*  Passthrough: send to the uart. Waits while a transaction runs. Returns number of bytes written */
+int uart_arbiter_write(const char *data, size_t len);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* UART_ARBITER_H_INCLUDED */
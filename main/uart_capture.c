@@ -0,0 +1,331 @@
+/*  Capture of the uart traffic of the TCP bridge.
+ *
+ *  The bridge task fills a batch buffer with records. Full batches, and batches that are UART_CAPTURE_FLUSH_MS old,
+ *  are handed to the writer task through a lock-free ring, and given back through another one when written, as the
+ *  SPI receiver does with the SD writer. Records are never split across batches, so a file always ends on a record.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/param.h>
+#include <sys/unistd.h>
+#include <stdatomic.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "spsc_ring.h"
+#include "uart_capture.h"
+
+
+typedef struct capture_batch {
+    size_t len;                 // Bytes of records in data
+    int64_t first;              // Time of the first record
+    uint8_t data[UART_CAPTURE_BATCH];
+} capture_batch_t;
+
+static const char *TAG = "UART_capture";
+
+static capture_batch_t *pool = NULL;
+static spsc_ring_t free_ring;           // Producer: writer task.  Consumer: bridge task
+static spsc_ring_t filled_ring;         // Producer: bridge task.  Consumer: writer task
+static capture_batch_t *current = NULL; // Batch filled by the bridge task
+static TaskHandle_t writer_handle = NULL;
+static uint32_t dropped = 0;            // Bytes not captured, no free batch. Written by the bridge task
+static atomic_bool stop_requested = false;
+static SemaphoreHandle_t stopped = NULL;        // Given by the writer task when the file is closed
+
+// Writer task only
+static FILE *file = NULL;
+static uint32_t file_bytes = 0;
+static uint32_t first_index = 0;        // Oldest capture file kept
+static uint32_t next_index = 0;         // Number of the next capture file, 0 until the folder has been read
+static uint32_t dropped_logged = 0;
+
+
+static void capture_path(char *path, size_t size, uint32_t index)
+{
+    snprintf(path, size, UART_CAPTURE_DIR "/%08u" UART_CAPTURE_EXT, index);
+}
+
+// Find the capture files left from before, so numbering continues after them
+static void scan_folder(void)
+{
+    mkdir(UART_CAPTURE_DIR, S_IRWXU);
+    first_index = UINT32_MAX;
+    next_index = 1;
+
+    DIR *dir = opendir(UART_CAPTURE_DIR);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        unsigned index;
+        char ext[8];
+        if (sscanf(entry->d_name, "%8u%7s", &index, ext) == 2 && strcasecmp(ext, UART_CAPTURE_EXT) == 0) {
+            first_index = MIN(first_index, index);
+            next_index = MAX(next_index, index + 1);
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    first_index = MIN(first_index, next_index);
+}
+
+// Start the next capture file, removing the oldest ones
+static bool open_next(void)
+{
+    char path[sizeof(UART_CAPTURE_DIR) + 16];
+
+    if (next_index == 0) {
+        scan_folder();
+    }
+    while (next_index - first_index >= UART_CAPTURE_KEEP_FILES) {
+        capture_path(path, sizeof(path), first_index++);
+        remove(path);
+    }
+
+    capture_path(path, sizeof(path), next_index);
+    file = fopen(path, "wb");
+    if (file == NULL) {
+        ESP_LOGW(TAG, "Cannot open capture file %s", path);
+        return false;
+    }
+    next_index++;
+    setvbuf(file, NULL, _IONBF, 0);        // Whole batches are written
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uart_capture_header_t header = {
+        .magic = UART_CAPTURE_MAGIC,
+        .version = UART_CAPTURE_VERSION,
+        .boot_time = now.tv_sec * 1000000LL + now.tv_usec - esp_timer_get_time(),
+    };
+    file_bytes = fwrite(&header, 1, sizeof(header), file);
+    ESP_LOGI(TAG, "Capturing uart traffic to %s", path);
+    return true;
+}
+
+static void write_batch(const capture_batch_t *batch)
+{
+    if (file == NULL && !open_next()) {
+        return;
+    }
+
+    if (fwrite(batch->data, 1, batch->len, file) != batch->len) {
+        ESP_LOGW(TAG, "Capture write failed, starting a new file");
+        fclose(file);
+        file = NULL;
+        return;
+    }
+    file_bytes += batch->len;
+    if (file_bytes >= UART_CAPTURE_ROTATE_BYTES) {
+        fclose(file);
+        file = NULL;
+    }
+}
+
+static void capture_task(void *arg)
+{
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Read before the ring, the last batch is pushed before the stop is asked for
+        bool stop = atomic_load(&stop_requested);
+        capture_batch_t *batch;
+        while ((batch = spsc_ring_pop(&filled_ring)) != NULL) {
+            write_batch(batch);
+            batch->len = 0;
+            spsc_ring_push(&free_ring, batch);
+        }
+        if (file != NULL) {
+            fsync(fileno(file));
+        }
+
+        uint32_t now_dropped = dropped;
+        if (now_dropped != dropped_logged) {
+            ESP_LOGW(TAG, "%u bytes of uart traffic not captured, the card is too slow", now_dropped - dropped_logged);
+            dropped_logged = now_dropped;
+        }
+
+        if (stop) {
+            if (file != NULL) {
+                fclose(file);
+                file = NULL;
+            }
+            xSemaphoreGive(stopped);
+            vTaskSuspend(NULL);
+        }
+    }
+}
+
+void uart_capture_start(void)
+{
+    if (writer_handle != NULL) {
+        return;
+    }
+
+    pool = calloc(UART_CAPTURE_BUFFERS, sizeof(capture_batch_t));
+    // A ring holds size - 1 elements
+    if (pool == NULL || !spsc_ring_init(&free_ring, UART_CAPTURE_BUFFERS * 2)
+            || !spsc_ring_init(&filled_ring, UART_CAPTURE_BUFFERS * 2)) {
+        ESP_LOGE(TAG, "Out of memory, uart traffic is not captured");
+        return;
+    }
+    for (int i = 0; i < UART_CAPTURE_BUFFERS; i++) {
+        spsc_ring_push(&free_ring, &pool[i]);
+    }
+    stopped = xSemaphoreCreateBinary();
+    xTaskCreate(capture_task, "uart_capture", 1024*3, NULL, UART_CAPTURE_PRIORITY, &writer_handle);
+}
+
+static void hand_over(void)
+{
+    spsc_ring_push(&filled_ring, current);
+    current = NULL;
+    xTaskNotifyGive(writer_handle);
+}
+
+void uart_capture_data(uint8_t dir, const void *data, size_t len)
+{
+    const size_t max_len = UART_CAPTURE_BATCH - sizeof(uart_capture_record_t);
+    int64_t now = esp_timer_get_time();
+
+    if (writer_handle == NULL || atomic_load(&stop_requested)) {
+        return;
+    }
+
+    while (len > 0) {
+        size_t part = MIN(len, max_len);
+        if (current != NULL && current->len + sizeof(uart_capture_record_t) + part > UART_CAPTURE_BATCH) {
+            hand_over();
+        }
+        if (current == NULL) {
+            current = spsc_ring_pop(&free_ring);
+            if (current == NULL) {
+                dropped += len;
+                return;
+            }
+            current->first = now;
+        }
+
+        uart_capture_record_t record = {
+            .time = now,
+            .len = part,
+            .dir = dir,
+        };
+        memcpy(current->data + current->len, &record, sizeof(record));
+        memcpy(current->data + current->len + sizeof(record), data, part);
+        current->len += sizeof(record) + part;
+
+        data = (const uint8_t *)data + part;
+        len -= part;
+    }
+}
+
+bool uart_capture_stop(uint32_t timeout_ms)
+{
+    if (writer_handle == NULL || stopped == NULL) {
+        return true;
+    }
+    if (current != NULL) {
+        hand_over();
+    }
+    atomic_store(&stop_requested, true);
+    xTaskNotifyGive(writer_handle);
+    if (xSemaphoreTake(stopped, timeout_ms / portTICK_PERIOD_MS) != pdTRUE) {
+        ESP_LOGW(TAG, "Capture writer not done in %u ms", timeout_ms);
+        return false;
+    }
+    return true;
+}
+
+int uart_capture_poll(void)
+{
+    if (current == NULL || atomic_load(&stop_requested)) {
+        return -1;
+    }
+    int64_t age_ms = (esp_timer_get_time() - current->first) / 1000;
+    if (age_ms >= UART_CAPTURE_FLUSH_MS) {
+        hand_over();
+        return -1;
+    }
+    return UART_CAPTURE_FLUSH_MS - age_ms;
+}
+
+
+// Add a character to the text, escaped if not printable
+static size_t escape_char(char *out, uint8_t c)
+{
+    switch (c) {
+        case '\r': return sprintf(out, "\\r");
+        case '\n': return sprintf(out, "\\n");
+        case '\t': return sprintf(out, "\\t");
+        case '\\': return sprintf(out, "\\\\");
+        default:
+            if (c >= 0x20 && c < 0x7f) {
+                *out = c;
+                return 1;
+            }
+            return sprintf(out, "\\x%02x", c);
+    }
+}
+
+esp_err_t uart_capture_to_text(FILE *fd, uint8_t *in, char *out, size_t out_size, uart_capture_output_cb output, void *ctx)
+{
+    // Room for the start of a line or one escaped character, before the text is sent
+    const size_t reserve = 64;
+    uart_capture_header_t header;
+    uart_capture_record_t record;
+    size_t len = 0;
+    esp_err_t err;
+
+    if (fread(&header, sizeof(header), 1, fd) != 1 || header.magic != UART_CAPTURE_MAGIC
+            || header.version != UART_CAPTURE_VERSION) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    while (fread(&record, sizeof(record), 1, fd) == 1) {
+        if (record.len > UART_CAPTURE_BATCH || fread(in, 1, record.len, fd) != record.len) {
+            // The last record can be cut if the device went to sleep while writing
+            break;
+        }
+
+        int64_t time = header.boot_time + record.time;
+        time_t seconds = time / 1000000;
+        struct tm tm;
+        gmtime_r(&seconds, &tm);
+        len += strftime(out + len, out_size - len, "%Y-%m-%d %H:%M:%S", &tm);
+        len += snprintf(out + len, out_size - len, ".%06u %s ", (unsigned)(time % 1000000),
+                        record.dir == UART_CAPTURE_TX ? "TX" : "RX");
+
+        for (size_t i = 0; i < record.len; i++) {
+            if (out_size - len < reserve) {
+                if ((err = output(ctx, out, len)) != ESP_OK) {
+                    return err;
+                }
+                len = 0;
+            }
+            len += escape_char(out + len, in[i]);
+        }
+        out[len++] = '\n';
+
+        if (out_size - len < reserve) {
+            if ((err = output(ctx, out, len)) != ESP_OK) {
+                return err;
+            }
+            len = 0;
+        }
+    }
+
+    return len > 0 ? output(ctx, out, len) : ESP_OK;
+}
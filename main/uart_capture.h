@@ -0,0 +1,84 @@
+#pragma once
+#ifndef UART_CAPTURE_H_INCLUDED
+#define UART_CAPTURE_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "sdmmc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*  Capture of the uart traffic of the TCP bridge (CONFIG_UART_CAPTURE).
+ *  Both directions are recorded with their time to capture files on the sd card, for transcripts of the sensor
+ *  console. The bridge only copies the data into a batch buffer, a writer task writes full batches to the card, so
+ *  capture never delays the bridge. When no batch buffer is free, data is dropped from the capture and counted.
+ *
+ *  Files are UART_CAPTURE_DIR/00000001.cap, 00000002.cap, ... A new file is started after
+ *  UART_CAPTURE_ROTATE_BYTES, and only the UART_CAPTURE_KEEP_FILES newest files are kept.
+ *  File format, little endian: uart_capture_header_t, then one uart_capture_record_t per record followed by len
+ *  bytes of data. Files can be downloaded as text from the web interface with "?text".
+ */
+
+#define UART_CAPTURE_DIR            SD_MOUNT "/uartcap"
+#define UART_CAPTURE_EXT            ".cap"
+#define UART_CAPTURE_MAGIC          0x50414355                          /* "UCAP" */
+#define UART_CAPTURE_VERSION        1
+#define UART_CAPTURE_ROTATE_BYTES   CONFIG_UART_CAPTURE_ROTATE_BYTES
+#define UART_CAPTURE_KEEP_FILES     CONFIG_UART_CAPTURE_KEEP_FILES
+
+#define UART_CAPTURE_BUFFERS        4           /* Batch buffers, allocated memmory: UART_CAPTURE_BUFFERS * UART_CAPTURE_BATCH */
+#define UART_CAPTURE_BATCH          4096        /* Bytes of records written to the card at a time */
+#define UART_CAPTURE_FLUSH_MS       500         /* A batch is written when it is this old, also if not full */
+#define UART_CAPTURE_PRIORITY       3           /* Below the bridge, the capture can wait */
+
+typedef struct __attribute__((packed)) uart_capture_header {
+    uint32_t magic;             /* UART_CAPTURE_MAGIC */
+    uint16_t version;           /* UART_CAPTURE_VERSION */
+    uint16_t reserved;
+    int64_t boot_time;          /* Time of day at boot, micro seconds since 1970. Record time + boot_time is time of day */
+} uart_capture_header_t;
+
+/* Directions */
+#define UART_CAPTURE_RX     0   /* Received on the uart, from the sensor */
+#define UART_CAPTURE_TX     1   /* Sent on the uart, from the TCP client */
+
+typedef struct __attribute__((packed)) uart_capture_record {
+    uint64_t time;              /* Micro seconds since boot */
+    uint16_t len;               /* Bytes of data following the record */
+    uint8_t dir;                /* UART_CAPTURE_RX or UART_CAPTURE_TX */
+    uint8_t reserved;
+} uart_capture_record_t;
+
+
+/*  Allocate the batch buffers and start the writer task */
+void uart_capture_start(void);
+
+/*  Add uart data to the capture. Only to be called from the bridge task */
+void uart_capture_data(uint8_t dir, const void *data, size_t len);
+
+/*  Write what is captured and close the file, before the card is unmounted. The writer task is then parked.
+ *  Called at shutdown after the bridge task has ended. Waits up to timeout_ms, returns true if the file is closed */
+bool uart_capture_stop(uint32_t timeout_ms);
+
+/*  Hand a partly filled batch to the writer when it is UART_CAPTURE_FLUSH_MS old. Only to be called from the bridge
+ *  task. Returns milli seconds until it should be called again, -1 if no data is waiting */
+int uart_capture_poll(void);
+
+/* Called with text of a capture file. Return ESP_OK to continue */
+typedef esp_err_t (*uart_capture_output_cb)(void *ctx, const char *text, size_t len);
+
+/*  Convert a capture file to text, one line per record: time of day, direction and data, with non printable
+ *  characters escaped. in must hold UART_CAPTURE_BATCH bytes, out at least 128 bytes.
+ *  Returns ESP_OK when the whole file is converted */
+esp_err_t uart_capture_to_text(FILE *fd, uint8_t *in, char *out, size_t out_size, uart_capture_output_cb output, void *ctx);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* UART_CAPTURE_H_INCLUDED */
@@ -0,0 +1,197 @@
+/*  Store and forward of uart output for the TCP bridge.
+ *
+ *  The stored data is always the unread part of the spill file followed by the RAM ring, so appending to the file
+ *  while it is replayed keeps the order. The file is removed when a replay has sent everything.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+
+#include "sdmmc.h"
+#include "byte_ring.h"
+#include "uart_store.h"
+
+_Static_assert((UART_STORE_RAM_SIZE & (UART_STORE_RAM_SIZE - 1)) == 0, "UART_STORE_RAM_SIZE must be a power of two");
+
+static const char *TAG = "UART_store";
+static const char *path = SD_MOUNT "/" UART_STORE_FILE;
+
+static byte_ring_t ring;
+static FILE *file = NULL;
+static uint32_t file_size = 0;          // Bytes written to the spill file
+static uint32_t file_offset = 0;        // Bytes of the spill file already replayed
+static uart_store_stats_t stats;
+
+
+void uart_store_init(void)
+{
+    if (ring.data == NULL && !byte_ring_init(&ring, UART_STORE_RAM_SIZE)) {
+        ESP_LOGE(TAG, "Out of memory, uart output is not stored");
+        return;
+    }
+
+    struct stat st;
+    if (file == NULL && stat(path, &st) == 0 && st.st_size > 0) {
+        file = fopen(path, "r+b");
+        if (file != NULL) {
+            file_size = st.st_size;
+            file_offset = 0;
+            stats.pending = file_size;
+            ESP_LOGI(TAG, "%u bytes stored before sleep, replayed to the next client", file_size);
+        }
+    }
+}
+
+// Move the RAM ring to the end of the spill file. Returns false if it did not fit
+static bool spill(void)
+{
+    size_t len = byte_ring_used(&ring);
+    if (UART_STORE_FILE_MAX == 0 || file_size + len > UART_STORE_FILE_MAX) {
+        return false;
+    }
+    if (file == NULL) {
+        file = fopen(path, "w+b");
+        if (file == NULL) {
+            return false;
+        }
+        file_size = 0;
+        file_offset = 0;
+    }
+
+    fseek(file, file_size, SEEK_SET);
+    const uint8_t *data;
+    while ((len = byte_ring_peek(&ring, &data)) > 0) {
+        size_t written = fwrite(data, 1, len, file);
+        file_size += written;
+        byte_ring_consume(&ring, written);
+        if (written < len) {
+            ESP_LOGW(TAG, "Write to %s failed", path);
+            return false;
+        }
+    }
+    // The directory entry gets the new size, so the data is found again after a sleep
+    fflush(file);
+    fsync(fileno(file));
+    return true;
+}
+
+void uart_store_append(const char *data, size_t len)
+{
+    if (ring.data == NULL) {
+        stats.dropped += len;
+        return;
+    }
+
+    size_t stored = byte_ring_write(&ring, data, len);
+    if (stored < len && spill()) {
+        stored += byte_ring_write(&ring, data + stored, len - stored);
+    }
+    stats.stored += stored;
+    stats.pending += stored;
+    stats.dropped += len - stored;
+}
+
+size_t uart_store_pending(void)
+{
+    return stats.pending;
+}
+
+void uart_store_replay_start(void)
+{
+    ESP_LOGI(TAG, "Replaying %u stored bytes", stats.pending);
+    stats.replaying = true;
+    stats.replay_sent = 0;
+}
+
+void uart_store_replay_abort(void)
+{
+    ESP_LOGW(TAG, "Replay stopped after %u bytes, %u bytes left", stats.replay_sent, stats.pending);
+    stats.replaying = false;
+}
+
+// Count bytes sent from the store
+static void sent(size_t len)
+{
+    stats.replayed += len;
+    stats.replay_sent += len;
+    stats.pending -= len;
+}
+
+int uart_store_replay(int sock, char *buf, size_t size)
+{
+    // Spill file first, it holds the oldest data. A part the socket did not take is read again next time.
+    while (file != NULL && file_offset < file_size) {
+        fseek(file, file_offset, SEEK_SET);
+        size_t len = fread(buf, 1, MIN(size, file_size - file_offset), file);
+        if (len == 0) {
+            ESP_LOGW(TAG, "Read of %s failed, %u bytes lost", path, file_size - file_offset);
+            stats.dropped += file_size - file_offset;
+            stats.pending -= file_size - file_offset;
+            file_offset = file_size;
+            break;
+        }
+        int written = send(sock, buf, len, MSG_DONTWAIT);
+        if (written < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        file_offset += written;
+        sent(written);
+        if ((size_t)written < len) {
+            return 0;
+        }
+    }
+
+    // The whole file is sent
+    if (file != NULL) {
+        fclose(file);
+        file = NULL;
+        remove(path);
+        file_size = 0;
+        file_offset = 0;
+    }
+
+    const uint8_t *data;
+    size_t len;
+    while ((len = byte_ring_peek(&ring, &data)) > 0) {
+        int written = send(sock, data, len, MSG_DONTWAIT);
+        if (written < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        byte_ring_consume(&ring, written);
+        sent(written);
+        if ((size_t)written < len) {
+            return 0;
+        }
+    }
+
+    ESP_LOGI(TAG, "Replay done, %u bytes sent", stats.replay_sent);
+    stats.replaying = false;
+    return 1;
+}
+
+void uart_store_close(void)
+{
+    size_t used = ring.data != NULL ? byte_ring_used(&ring) : 0;
+    if (used > 0 && !spill()) {
+        ESP_LOGW(TAG, "%u bytes in RAM not kept over sleep", used);
+    }
+    if (file != NULL) {
+        fclose(file);
+        file = NULL;
+    }
+}
+
+void uart_store_get_stats(uart_store_stats_t *out)
+{
+    *out = stats;
+}
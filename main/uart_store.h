@@ -0,0 +1,68 @@
+#pragma once
+#ifndef UART_STORE_H_INCLUDED
+#define UART_STORE_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*  Store and forward of uart output for the TCP bridge.
+ *  While no client is connected, uart output is kept in a RAM ring. When the ring is full it is appended to a spill
+ *  file on the sd card. The next client to connect first gets the stored data, as fast as the socket takes it, then
+ *  the live output. Output arriving during the replay is stored behind the rest, so nothing is sent out of order.
+ *  Output that fits neither in RAM nor in the spill file is dropped and counted.
+ *  The spill file is kept over deep sleep and replayed after the next Wi-Fi wake up. uart_store_close() adds the
+ *  RAM ring to it before sleep.
+ *  Only used by the bridge task, except uart_store_get_stats().
+ */
+
+#define UART_STORE_RAM_SIZE     CONFIG_UART_STORE_RAM_SIZE      /* Bytes kept in RAM before spilling to the card, power of two */
+#define UART_STORE_FILE_MAX     CONFIG_UART_STORE_FILE_MAX      /* Max size of the spill file, 0 = RAM only */
+#define UART_STORE_FILE         "uart_store.bin"                /* In the root folder of the card */
+
+typedef struct uart_store_stats {
+    uint64_t stored;            /* Bytes stored since boot */
+    uint64_t replayed;          /* Bytes sent from the store since boot */
+    uint64_t dropped;           /* Bytes lost since boot, RAM ring and spill file full */
+    uint32_t pending;           /* Bytes waiting to be replayed, in RAM and spill file */
+    uint32_t replay_sent;       /* Bytes sent by the current or last replay. Progress is replay_sent / (replay_sent + pending) */
+    bool replaying;             /* A client is getting the stored data */
+} uart_store_stats_t;
+
+
+/*  Allocate the RAM ring, and take over a spill file left from before deep sleep. Called when the bridge starts */
+void uart_store_init(void);
+
+/*  Store uart output */
+void uart_store_append(const char *data, size_t len);
+
+/*  Number of bytes waiting to be replayed */
+size_t uart_store_pending(void);
+
+/*  Start a replay. Stored data is then sent with uart_store_replay() */
+void uart_store_replay_start(void);
+
+/*  A replay ended before it was done, the client disconnected. The data not sent stays in the store */
+void uart_store_replay_abort(void);
+
+/*  Send stored data to a socket, as much as it takes without blocking. buf is used to read the spill file.
+ *  Returns 1 when the store is empty and the replay is done, 0 if more is to be sent, -1 on socket error */
+int uart_store_replay(int sock, char *buf, size_t size);
+
+/*  Spill the RAM ring and close the spill file, before the card is unmounted. Called at shutdown, after the
+ *  bridge task has ended */
+void uart_store_close(void);
+
+/*  Get the counters. Can be called from any task */
+void uart_store_get_stats(uart_store_stats_t *out);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* UART_STORE_H_INCLUDED */
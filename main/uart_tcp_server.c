@@ -15,10 +15,15 @@
 #include <sys/fcntl.h>
 #include <sys/errno.h>
 #include <sys/unistd.h>
+#include <stdatomic.h>
 
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
 #include "driver/uart.h"
+#include "esp_vfs_dev.h"
 #include <sys/param.h>
 #include "nvs_flash.h"
 
@@ -29,113 +34,318 @@
 #include "driver/gpio.h"
 #include "soc/uart_reg.h"
 
-
+#include "byte_ring.h"
+#include "uart_store.h"
+#include "uart_capture.h"
+#include "uart_arbiter.h"
 #include "uart_tcp_server.h"
 
-// Socket file stream
-static int sock = - 1;
+_Static_assert((TCP_CLIENT_BUF_SIZE & (TCP_CLIENT_BUF_SIZE - 1)) == 0, "TCP_SERVER_CLIENT_BUFFER must be a power of two");
+
+// A connected client of the bridge. The first client owns the uart, the others only see its output.
+typedef struct tcp_client {
+    int sock;                   // -1 if the slot is free
+    bool owner;                 // Data received from the client is sent to the uart
+    uint32_t seq;               // Connection order, the oldest observer becomes owner when the owner leaves
+    byte_ring_t pending;        // Uart data not yet accepted by the socket
+    uint32_t dropped;           // Uart data lost because pending was full
+    bool replaying;             // Gets the data stored while no client was connected, before the live output
+} tcp_client_t;
+
+// Only used by the bridge task, so no locking is needed
+static tcp_client_t clients[TCP_MAX_CLIENTS] = {
+    [0 ... TCP_MAX_CLIENTS - 1] = { .sock = -1 },
+};
+static uint32_t client_seq = 0;
+static int listen_sock = -1;
+static atomic_bool stopping = false;
+static SemaphoreHandle_t stopped = NULL;        // Given when the server task ends
 
 static const char *TAG = "TCP_server";
 
+// Empty the RX FIFO earlier at high rates, so it does not overflow while the interrupt waits for the CPU
+static void set_rx_threshold(uint32_t baud)
+{
+    uart_set_rx_full_threshold(EX_UART_NUM, baud > UART_BAUD_FAST ? UART_RX_FULL_THRESH_FAST : UART_RX_FULL_THRESH);
+}
+
 void uart_init(void)
 {
     uart_config_t uart_config = {
-        .baud_rate = 115200,
+        .baud_rate = UART_BAUD_DEFAULT,
         .data_bits = UART_DATA_8_BITS,
         .parity    = UART_PARITY_DISABLE,
         .stop_bits = UART_STOP_BITS_1,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .flow_ctrl = UART_HW_FLOW_CTRL ? UART_HW_FLOWCTRL_CTS_RTS : UART_HW_FLOWCTRL_DISABLE,
+        .rx_flow_ctrl_thresh = UART_RTS_THRESH,
         .source_clk = UART_SCLK_APB,
     };
 
 
     uart_param_config(EX_UART_NUM, &uart_config);
-    uart_set_pin(EX_UART_NUM, TXD_PIN, RXD_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-    uart_driver_install(EX_UART_NUM, UART_RX_BUF_SIZE, 0, 0, NULL, 0);
-    uart_set_sw_flow_ctrl(EX_UART_NUM, true, 1, 120);       /* enable xon/xoff flow control. FIFO buffer is 128 Bytes. */
+    uart_set_pin(EX_UART_NUM, TXD_PIN, RXD_PIN, RTS_PIN, CTS_PIN);
+    uart_driver_install(EX_UART_NUM, UART_RX_BUF_SIZE, UART_TX_BUF_SIZE, 0, NULL, 0);
+    if (!UART_HW_FLOW_CTRL) {
+        uart_set_sw_flow_ctrl(EX_UART_NUM, true, 1, 120);       /* enable xon/xoff flow control. FIFO buffer is 128 Bytes. */
+    }
+
+    // Received data is passed to the driver buffer, and select() on the uart returns, when the line has been idle
+    // for UART_RX_IDLE_SYMBOLS, instead of the default 10
+    uart_set_rx_timeout(EX_UART_NUM, UART_RX_IDLE_SYMBOLS);
+    set_rx_threshold(UART_BAUD_DEFAULT);
 }
 
-void rx_task(void *arg)
+void uart_set_speed(uint32_t baud)
 {
-    static const char *RX_TASK_TAG = "UART_RX_TASK";
-    if (!uart_is_driver_installed(EX_UART_NUM)) {
-        uart_init();
+    uart_wait_tx_done(EX_UART_NUM, 100 / portTICK_PERIOD_MS);
+    uart_set_baudrate(EX_UART_NUM, baud);
+    set_rx_threshold(baud);
+    ESP_LOGI(TAG, "Uart at %u baud", (unsigned)baud);
+}
+
+// Send as much of data as the socket takes without blocking. Returns the number of bytes sent, -1 on error
+static int send_nonblocking(int sock, const void *data, size_t len)
+{
+    int written = send(sock, data, len, MSG_DONTWAIT);
+    if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        written = 0;
     }
-    
-    char* data = (char*) malloc(UART_RX_BUF_SIZE);
-    int written = 1;
-    while (1)
-    {
-        memset(data, 0xdd, UART_RX_BUF_SIZE);
-        const int rxBytes = uart_read_bytes(EX_UART_NUM, data, UART_RX_BUF_SIZE, 100 / portTICK_PERIOD_MS);
-        if (rxBytes > 0 ) {
-
-            // send() command can return less bytes than supplied length.
-            // Walk-around for robust implementation.
-            int to_write = rxBytes; 
-            while (to_write > 0) {
-                // send will attempt to send data received on uart2 to a socket. If socket is not connected, send will return -1.
-                // Otherwise it will return the number of bytes actually sent.
-                written = send(sock, data + (rxBytes - to_write), to_write, 0);
-                
-                ESP_LOGI(RX_TASK_TAG, "Received %i bytes from UART. Sent to SOCKET: %d bytes", rxBytes, written);
-
-                if (written < 0) {
-                    ESP_LOGW(RX_TASK_TAG, "Error occurred during sending to socket: Error no: %d", errno);
-                    break;
-                }
-                to_write -= written;
-           }
-        }
-    } 
+    return written;
+}
 
-    free(data);
-    uart_driver_delete(EX_UART_NUM);
-    ESP_LOGI(RX_TASK_TAG, "Uart driver uninstalled");
-    vTaskDelete(NULL);
+// Send what is pending for a client. Returns true if the pending data is all sent.
+static bool flush_client(tcp_client_t *client)
+{
+    const uint8_t *data;
+    size_t len;
+    while ((len = byte_ring_peek(&client->pending, &data)) > 0) {
+        int written = send_nonblocking(client->sock, data, len);
+        if (written < 0) {
+            // select() then reports the socket readable, and recv() fails
+            ESP_LOGW(TAG, "Error occurred during sending to socket: Error no: %d", errno);
+            shutdown(client->sock, SHUT_RDWR);
+            byte_ring_clear(&client->pending);
+            return true;
+        }
+        byte_ring_consume(&client->pending, written);
+        if ((size_t)written < len) {
+            return false;
+        }
+    }
+    return true;
 }
 
+// Send data received on uart to all clients. A client that does not keep up gets the data in its pending ring,
+// so the loop never waits for a socket. Data is stored if no client is connected, or a client is getting the
+// stored data, which then gets this data after it.
+static void forward_to_clients(const char *data, int len)
+{
+    static const char *RX_TASK_TAG = "UART_RX";
+    bool connected = false;
+    bool replaying = false;
+
+    for (int i = 0; i < TCP_MAX_CLIENTS; i++) {
+        tcp_client_t *client = &clients[i];
+        if (client->sock < 0) {
+            continue;
+        }
+        connected = true;
+        if (client->replaying) {
+            replaying = true;
+            continue;
+        }
+
+        // Straight from the shared buffer when nothing is pending, only the part the socket did not take is copied
+        int written = 0;
+        if (flush_client(client)) {
+            written = send_nonblocking(client->sock, data, len);
+            if (written < 0) {
+                ESP_LOGW(TAG, "Error occurred during sending to socket: Error no: %d", errno);
+                shutdown(client->sock, SHUT_RDWR);
+                continue;
+            }
+        }
+        if (written < len) {
+            size_t stored = byte_ring_write(&client->pending, data + written, len - written);
+            client->dropped += len - written - stored;
+        }
+        ESP_LOGD(RX_TASK_TAG, "Received %i bytes from UART. Sent to client %u: %d bytes", len, client->seq, written);
+    }
 
+    if (!connected || replaying) {
+        uart_store_append(data, len);
+    }
+}
 
-/* Function to receive data on open socket and retransmit to uart */
-static void do_retransmit(const int sock)       
+// Read everything the uart driver has received and send it to the clients.
+// The driver is read through the arbiter, the VFS read would go byte by byte and convert line endings.
+static void do_uart_receive(char *buf)
 {
-    int len;
-    char* rx_buffer = (char*) malloc(RX_BUF_SIZE);
-    static const char *TX_TASK_TAG = "SOCKET_RX_TASK";
-    esp_log_level_set(TX_TASK_TAG, ESP_LOG_INFO);
-    //size_t uart_buf_len = -1;
+    int rxBytes;
     do {
-        //memset(rx_buffer, 0xee, RX_BUF_SIZE);
-        len = recv(sock, rx_buffer, RX_BUF_SIZE, 0);
+        rxBytes = uart_arbiter_read(buf, BRIDGE_BUF_SIZE);
+        if (rxBytes <= 0) {
+            break;
+        }
+        forward_to_clients(buf, rxBytes);
+#ifdef CONFIG_UART_CAPTURE
+        uart_capture_data(UART_CAPTURE_RX, buf, rxBytes);
+#endif
+    } while (rxBytes == BRIDGE_BUF_SIZE);
+}
 
-        if (len < 0) {
-            ESP_LOGE(TX_TASK_TAG, "Error occurred during receiving: (%d)", errno);
-        } else if (len == 0) {
-            ESP_LOGW(TX_TASK_TAG, "Connection closed");
+
+// Add an accepted socket to the clients. Returns false if all slots are in use.
+static bool add_client(int sock, const char *addr_str)
+{
+    bool have_owner = false;
+    bool replaying = false;
+    tcp_client_t *free_slot = NULL;
+
+    for (int i = 0; i < TCP_MAX_CLIENTS; i++) {
+        if (clients[i].sock < 0) {
+            free_slot = free_slot ? free_slot : &clients[i];
         } else {
-            //ESP_LOGI(TX_TASK_TAG, "Received %d bytes from socket", len);
-            const int txBytes = uart_write_bytes(EX_UART_NUM, rx_buffer, len);
-            ESP_LOGI(TX_TASK_TAG, "Received %d bytes from socket. Sent %i bytes to UART", len, txBytes);
+            have_owner |= clients[i].owner;
+            replaying |= clients[i].replaying;
+        }
+    }
+    if (free_slot == NULL || !byte_ring_init(&free_slot->pending, TCP_CLIENT_BUF_SIZE)) {
+        return false;
+    }
+
+    free_slot->owner = !have_owner;
+    free_slot->seq = ++client_seq;
+    free_slot->dropped = 0;
+    free_slot->sock = sock;
+    free_slot->replaying = !replaying && uart_store_pending() > 0;
+    if (free_slot->replaying) {
+        uart_store_replay_start();
+    }
+
+    ESP_LOGI(TAG, "Client %u connected from %s, %s", free_slot->seq, addr_str, free_slot->owner ? "owner" : "observer");
+    return true;
+}
+
+// Close and remove a client. If it was the owner, the oldest observer becomes owner.
+static void remove_client(tcp_client_t *client)
+{
+    shutdown(client->sock, 0);
+    close(client->sock);
+    client->sock = -1;
+    byte_ring_free(&client->pending);
+    if (client->replaying) {
+        client->replaying = false;
+        uart_store_replay_abort();
+    }
+    ESP_LOGI(TAG, "Client %u disconnected, %u bytes dropped", client->seq, client->dropped);
+
+    if (!client->owner) {
+        return;
+    }
+    client->owner = false;
+
+    tcp_client_t *next = NULL;
+    for (int i = 0; i < TCP_MAX_CLIENTS; i++) {
+        if (clients[i].sock >= 0 && (next == NULL || clients[i].seq < next->seq)) {
+            next = &clients[i];
+        }
+    }
+    if (next != NULL) {
+        next->owner = true;
+        ESP_LOGI(TAG, "Client %u is now owner", next->seq);
+    } else if (uart_arbiter_get_baud() != UART_BAUD_DEFAULT) {
+        // A bulk transfer at a higher rate is over. Not waited for, the select() loop must keep serving
+        if (uart_arbiter_set_baud_async(UART_BAUD_DEFAULT) != ESP_OK) {
+            ESP_LOGW(TAG, "Could not queue the baud rate reset");
         }
-        //printf("Free memmory: %i KB\n", esp_get_free_heap_size() / 1024);
-        //printf("Lowest free memmory since boot: %i KB\n", esp_get_minimum_free_heap_size() / 1024);
-    } while (len > 0);
-    free(rx_buffer);
-    ESP_LOGI(TX_TASK_TAG, "Exiting socket transmit function");
+    }
+}
+
+/* Function to receive data on a client socket and retransmit to uart. Returns false when the client is gone */
+static bool do_retransmit(tcp_client_t *client, char *buf)
+{
+    static const char *TX_TASK_TAG = "SOCKET_RX";
+
+    int len = recv(client->sock, buf, BRIDGE_BUF_SIZE, 0);
+    if (len < 0) {
+        ESP_LOGE(TX_TASK_TAG, "Error occurred during receiving: (%d)", errno);
+        return false;
+    } else if (len == 0) {
+        ESP_LOGW(TX_TASK_TAG, "Connection closed");
+        return false;
+    }
+
+    // Observers can only watch, what they send is discarded.
+    // Copied to the driver TX buffer, only waits if the uart is UART_TX_BUF_SIZE behind.
+    if (client->owner) {
+        const int txBytes = uart_arbiter_write(buf, len);
+        ESP_LOGD(TX_TASK_TAG, "Received %d bytes from socket. Sent %i bytes to UART", len, txBytes);
+#ifdef CONFIG_UART_CAPTURE
+        uart_capture_data(UART_CAPTURE_TX, buf, len);
+#endif
+    }
+    return true;
+}
 
+// Send stored data to a client. When all is sent, the client gets the live output.
+static void do_replay(tcp_client_t *client, char *buf)
+{
+    int ret = uart_store_replay(client->sock, buf, BRIDGE_BUF_SIZE);
+    if (ret > 0) {
+        client->replaying = false;
+    } else if (ret < 0) {
+        // select() then reports the socket readable, and recv() fails
+        ESP_LOGW(TAG, "Error occurred during sending to socket: Error no: %d", errno);
+        shutdown(client->sock, SHUT_RDWR);
+    }
 }
 
-void tcp_server_task(void *pvParameters)
+// Accept a connection on the listen socket
+static void do_accept(void)
 {
-    esp_log_level_set(TAG, ESP_LOG_INFO);
     char addr_str[128];
-    int addr_family = (int)pvParameters;
-    int ip_protocol = 0;
     int keepAlive = 1;
     int keepIdle = KEEPALIVE_IDLE;
     int keepInterval = KEEPALIVE_INTERVAL;
     int keepCount = KEEPALIVE_COUNT;
+
+    struct sockaddr_storage source_addr; // Large enough for both IPv4 or IPv6
+    socklen_t addr_len = sizeof(source_addr);
+    int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+        return;
+    }
+
+    // Set tcp keepalive option
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
+    // Send each line from the uart at once, without waiting for the ack of the previous one
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &keepAlive, sizeof(int));
+    // Convert ip address to string
+    if (source_addr.ss_family == PF_INET) {
+        inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
+    }
+#ifdef CONFIG_TCP_SERVER_IPV6
+    else if (source_addr.ss_family == PF_INET6) {
+        inet6_ntoa_r(((struct sockaddr_in6 *)&source_addr)->sin6_addr, addr_str, sizeof(addr_str) - 1);
+    }
+#endif
+
+    if (!add_client(sock, addr_str)) {
+        ESP_LOGW(TAG, "Refused connection from %s, %d clients connected", addr_str, TCP_MAX_CLIENTS);
+        shutdown(sock, 0);
+        close(sock);
+    }
+}
+
+// Create the listen socket. Returns false on error
+static bool open_listen_socket(int addr_family)
+{
+    int ip_protocol = 0;
     struct sockaddr_storage dest_addr;
 
     if (addr_family == AF_INET) {
@@ -155,19 +365,13 @@ void tcp_server_task(void *pvParameters)
     }
 #endif
 
-    int listen_sock = socket(addr_family, SOCK_STREAM, ip_protocol);
+    listen_sock = socket(addr_family, SOCK_STREAM, ip_protocol);
     if (listen_sock < 0) {
         ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
-        vTaskDelete(NULL);
-        return;
+        return false;
     }
     int opt = 1;
     setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-#if defined(CONFIG_TCP_SERVER_IPV4) && defined(CONFIG_TCP_SERVER_IPV6)
-    // Note that by default IPV6 binds to both protocols, it is must be disabled
-    // if both protocols used at the same time (used in CI)
-    setsockopt(listen_sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
-#endif
 
     ESP_LOGI(TAG, "Socket created");
 
@@ -175,54 +379,119 @@ void tcp_server_task(void *pvParameters)
     if (err != 0) {
         ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
         ESP_LOGE(TAG, "IPPROTO: %d", addr_family);
-        goto CLEAN_UP;
+        return false;
     }
     ESP_LOGI(TAG, "Socket bound, port %d", PORT);
 
-    err = listen(listen_sock, 1);
+    err = listen(listen_sock, TCP_MAX_CLIENTS);
     if (err != 0) {
         ESP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
-        goto CLEAN_UP;
+        return false;
     }
+    ESP_LOGI(TAG, "Socket listening");
+    return true;
+}
 
-    while (1) {
+// The bridge: one select() loop for the listen socket, the clients and the uart, sharing one buffer
+static void tcp_server_task(void *pvParameters)
+{
+    esp_log_level_set(TAG, ESP_LOG_INFO);
+    int uart_fd = -1;
+    char* buf = NULL;
 
-        ESP_LOGI(TAG, "Socket listening");
+    if (!open_listen_socket((int)pvParameters)) {
+        goto CLEAN_UP;
+    }
 
-        struct sockaddr_storage source_addr; // Large enough for both IPv4 or IPv6
-        socklen_t addr_len = sizeof(source_addr);
-        sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
-        if (sock < 0) {
-            ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
-            break;
-        }
+    uart_arbiter_start();
+    uart_arbiter_set_passthrough(true);
+    uart_store_init();
+#ifdef CONFIG_UART_CAPTURE
+    uart_capture_start();
+#endif
+    // The fd is only used to wait for the uart in select(), data is read and written through the arbiter
+    esp_vfs_dev_uart_use_driver(EX_UART_NUM);
+    uart_fd = open(UART_VFS_PATH, O_RDWR | O_NONBLOCK);
+    if (uart_fd < 0) {
+        ESP_LOGE(TAG, "Unable to open %s: errno %d", UART_VFS_PATH, errno);
+        goto CLEAN_UP;
+    }
 
-        // Set tcp keepalive option
-        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
-        // Convert ip address to string
-        if (source_addr.ss_family == PF_INET) {
-            inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
+    buf = (char*) malloc(BRIDGE_BUF_SIZE);
+
+    while (!stopping) {
+
+        // Wait for uart data, a new connection or data from any client, and for clients that are behind to take more
+        fd_set readfds, writefds;
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        FD_SET(listen_sock, &readfds);
+        FD_SET(uart_fd, &readfds);
+        int maxfd = MAX(listen_sock, uart_fd);
+        for (int i = 0; i < TCP_MAX_CLIENTS; i++) {
+            if (clients[i].sock >= 0) {
+                FD_SET(clients[i].sock, &readfds);
+                if (byte_ring_used(&clients[i].pending) > 0 || clients[i].replaying) {
+                    FD_SET(clients[i].sock, &writefds);
+                }
+                maxfd = MAX(maxfd, clients[i].sock);
+            }
         }
-#ifdef CONFIG_TCP_SERVER_IPV6
-        else if (source_addr.ss_family == PF_INET6) {
-            inet6_ntoa_r(((struct sockaddr_in6 *)&source_addr)->sin6_addr, addr_str, sizeof(addr_str) - 1);
+        struct timeval *wait = NULL;
+#ifdef CONFIG_UART_CAPTURE
+        // Wake up to hand a partly filled batch to the capture writer, also if the uart is quiet
+        struct timeval timeout;
+        int capture_ms = uart_capture_poll();
+        if (capture_ms >= 0) {
+            timeout.tv_sec = capture_ms / 1000;
+            timeout.tv_usec = (capture_ms % 1000) * 1000;
+            wait = &timeout;
         }
 #endif
-        ESP_LOGI(TAG, "Socket accepted ip address: %s", addr_str);
+        if (select(maxfd + 1, &readfds, &writefds, NULL, wait) < 0) {
+            ESP_LOGE(TAG, "Error occurred during select: errno %d", errno);
+            break;
+        }
 
-        do_retransmit(sock); // receive data on open socket
+        if (FD_ISSET(uart_fd, &readfds)) {
+            do_uart_receive(buf);
+        }
 
-        shutdown(sock, 0);
-        close(sock);
-        sock = -1;
+        for (int i = 0; i < TCP_MAX_CLIENTS; i++) {
+            if (clients[i].sock >= 0 && FD_ISSET(clients[i].sock, &writefds)) {
+                if (clients[i].replaying) {
+                    do_replay(&clients[i], buf);
+                } else {
+                    flush_client(&clients[i]);
+                }
+            }
+            if (clients[i].sock >= 0 && FD_ISSET(clients[i].sock, &readfds) && !do_retransmit(&clients[i], buf)) {
+                remove_client(&clients[i]);
+            }
+        }
+
+        if (FD_ISSET(listen_sock, &readfds) && !stopping) {
+            do_accept();
+        }
     }
 
 CLEAN_UP:
     ESP_LOGE(TAG, "Closing TCP-server Task, reboot device to start again");
-    close(listen_sock);
+    uart_arbiter_set_passthrough(false);
+    for (int i = 0; i < TCP_MAX_CLIENTS; i++) {
+        if (clients[i].sock >= 0) {
+            remove_client(&clients[i]);
+        }
+    }
+    free(buf);
+    if (uart_fd >= 0) {
+        close(uart_fd);
+    }
+    if (listen_sock >= 0) {
+        close(listen_sock);
+    }
+    listen_sock = -1;
+    xSemaphoreGive(stopped);
     vTaskDelete(NULL);
     //start_tcp_server_task();        //restart the task.
 
@@ -230,15 +499,38 @@ CLEAN_UP:
 
 void   start_tcp_server_task(void) 
 {
+    stopping = false;
+    if (stopped == NULL) {
+        stopped = xSemaphoreCreateBinary();
+    }
+    xSemaphoreTake(stopped, 0);
 
-#ifdef CONFIG_TCP_SERVER_IPV4
-    xTaskCreate(tcp_server_task, "tcp_server", 1024*4, (void*)AF_INET, 12, NULL);
-#endif
+    // One task owns the uart. IPV6 binds to both protocols by default, so it also takes IPV4 clients.
 #ifdef CONFIG_TCP_SERVER_IPV6
-    xTaskCreate(tcp_server_task, "tcp_server", 1024*4, (void*)AF_INET6, 12, NULL);
+    xTaskCreate(tcp_server_task, "tcp_server", 1024*3, (void*)AF_INET6, 12, NULL);
+#else
+    xTaskCreate(tcp_server_task, "tcp_server", 1024*3, (void*)AF_INET, 12, NULL);
 #endif
 }
 
+bool stop_tcp_server(uint32_t timeout_ms)
+{
+    // select() returns, and the server task closes the clients and ends
+    stopping = true;
+    if (listen_sock >= 0) {
+        shutdown(listen_sock, SHUT_RDWR);
+    }
+    if (stopped == NULL) {
+        return true;
+    }
+    if (xSemaphoreTake(stopped, timeout_ms / portTICK_PERIOD_MS) != pdTRUE) {
+        ESP_LOGW(TAG, "TCP server task did not end in %u ms", timeout_ms);
+        return false;
+    }
+    ESP_LOGI(TAG, "TCP server stopped");
+    return true;
+}
+
 uint8_t read_from_nvs(char *out_string)
 {
 	nvs_handle my_handle;
@@ -310,53 +602,27 @@ void replacechar(char *str, char orig, char rep) {
 // input: size_t n_times: Retry attempts if it fails to receive clock.
 uint8_t get_clock(size_t n_times)
 {
-
-    if (!uart_is_driver_installed(EX_UART_NUM)) {
-        uart_init();
-    }
-
-    char* buf = (char*) malloc(129);
-    char* cmd = "do_get clock\n";
-    uint8_t status = 0;
-    int rxBytes, error = 0;
+    char buf[129];
+    uart_transaction_t t = {
+        .cmd = "do_get clock\n",
+        .start = "#",               // The date is between two #
+        .end = "#",
+        .timeout_ms = UART_QUERY_TIMEOUT_MS,
+        .resp = buf,
+        .resp_size = sizeof(buf),
+    };
+    size_t error = 0;
     struct tm tm;
     char * ptr = NULL;
-    //int ch = '\n';
-    
-    do 
-    {
-        uart_write_bytes(EX_UART_NUM, cmd, strlen(cmd));
-        rxBytes = uart_read_bytes(EX_UART_NUM, buf, 128, 20 / portTICK_PERIOD_MS);
-        if (rxBytes > 0) {
-            buf[rxBytes] = '\0'; //Null-terminate
-            
-            // check that the first character is a '#'
-            if (strncmp(buf, "#", 1) == 0) {
-                // clock received
-                status = 1;
-            } else {
-                // in case we received something unexpected, wait until uart is free.
-                error++;
-                printf("UART busy, waiting...\n");
-                while (uart_read_bytes(EX_UART_NUM, buf, 128, 20 / portTICK_PERIOD_MS) > 0) {
-                    
-                }
-            }
 
-        } else {
-            ESP_LOGI(TAG, "ERROR  no reply from sensor");
-            //uart_flush_input(EX_UART_NUM);
-            error++;
-            vTaskDelay (500 / portTICK_PERIOD_MS );
-        }
-
-        if (error > n_times) {
+    while (uart_arbiter_transact(&t) != ESP_OK) {
+        ESP_LOGI(TAG, "ERROR  no reply from sensor");
+        if (++error > n_times) {
             ESP_LOGW(TAG, "Too many errors, aborting update clock");
-            status = 0;
-            return status;
+            return 0;
         }
-
-    } while (status == 0);
+        vTaskDelay (500 / portTICK_PERIOD_MS );
+    }
     
     //strip out date from received message:
     
@@ -365,69 +631,43 @@ uint8_t get_clock(size_t n_times)
         buf[(int)(ptr - buf - 1)] = '\0';
     }
     
-    ptr = strchr(buf, '#'); //Find first occurence of #
-    if (ptr != NULL) {
-        
-        if (strptime(ptr+2, "%Y.%m.%d %H:%M:%S", &tm) != NULL) {    // Need to add 2 to bypass # and end-of-line characters
-            time_t t = mktime(&tm);
-            ESP_LOGI(TAG, "Setting time: %s\n", asctime(&tm));
-            struct timeval now = { .tv_sec = t};
-            // This will update system time on wi-fi module.
-            settimeofday(&now, NULL);
-        }
+    // The first character is a '#'
+    ptr = buf;
+    if (strptime(ptr+2, "%Y.%m.%d %H:%M:%S", &tm) != NULL) {    // Need to add 2 to bypass # and end-of-line characters
+        time_t t = mktime(&tm);
+        ESP_LOGI(TAG, "Setting time: %s\n", asctime(&tm));
+        struct timeval now = { .tv_sec = t};
+        // This will update system time on wi-fi module.
+        settimeofday(&now, NULL);
     } else {
         ESP_LOGW(TAG, "Failed getting date from uart");
-        status = 0;
+        return 0;
     }
-    
-    free(buf);
-
-    uart_driver_delete(EX_UART_NUM);
 
-    return status;
+    return 1;
 }
 
 uint8_t get_node_description(char * out_string, size_t max_tries)
 {
-    if (!uart_is_driver_installed(EX_UART_NUM)) {
-        uart_init();
-    }
-    char* buf = (char*) malloc(129);
-    char* cmd = "get_node description\n";
-    int iCharsConsumed, end, len, rxBytes, error_counter=0;
-    uint8_t status = 0;
-    char *pch;
+    char buf[129];
+    uart_transaction_t t = {
+        .cmd = "get_node description\n",
+        .start = "Node Description",
+        .end = "\n",
+        .timeout_ms = UART_QUERY_TIMEOUT_MS,
+        .resp = buf,
+        .resp_size = sizeof(buf),
+    };
+    int iCharsConsumed, end, len;
+    size_t error_counter = 0;
+    char *pch = buf;
 
-    do {
-        uart_write_bytes(EX_UART_NUM, cmd, strlen(cmd));
-        rxBytes = uart_read_bytes(EX_UART_NUM, buf, 128, 20 / portTICK_PERIOD_MS);
-        
-        if (rxBytes > 0) {
-            buf[rxBytes] = 0; // Null terminate.
-            //ESP_LOGI("GET SSID", "Received the following %i characters: %s\n",rxBytes, buf );
-            pch = strcasestr( buf, "Node Description" );
-            
-            if (pch == NULL) 
-            {
-                error_counter++;
-                printf("UART busy, waiting...\n");
-                while (uart_read_bytes(EX_UART_NUM, buf, 128, 20 / portTICK_PERIOD_MS) > 0) {
-                    
-                }
-                
-            }    
-        }
-        else {
-            uart_flush_input(EX_UART_NUM); 
-            //vTaskDelay (1000 / portTICK_PERIOD_MS );
-            error_counter++;
-        } 
-        if (error_counter > max_tries) {
+    while (uart_arbiter_transact(&t) != ESP_OK) {
+        if (++error_counter > max_tries) {
             ESP_LOGI("GET SSID", "ERROR getting node description");
-            status = 0;
-            return status;
+            return 0;
         }
-    } while ((pch = strcasestr( buf, "Node Description")) == NULL);
+    }
   
     int product, serial;
 
@@ -443,9 +683,5 @@ uint8_t get_node_description(char * out_string, size_t max_tries)
     replacechar(out_string, '#', '0');
 
     ESP_LOGI(TAG, "Got the following name: %s", out_string);
-    free(buf);
-    uart_flush_input(EX_UART_NUM);
-    uart_driver_delete(EX_UART_NUM);
-    status = 1;
-    return status;
-}
\ No newline at end of file
+    return 1;
+}
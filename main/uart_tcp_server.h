@@ -2,6 +2,9 @@
 #ifndef UART_TCP_SERVER_H_INCLUDED
 #define UART_TCP_SERVER_H_INCLUDED
 
+#include <stdint.h>
+#include <stdbool.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -10,45 +13,80 @@ extern "C" {
 #define KEEPALIVE_IDLE              CONFIG_TCP_SERVER_KEEPALIVE_IDLE         /*  Keep-alive idle time. In idle time without receiving any data from peer, will send keep-alive probe packet */
 #define KEEPALIVE_INTERVAL          CONFIG_TCP_SERVER_KEEPALIVE_INTERVAL     /*  Keep-alive probe packet interval time.    */
 #define KEEPALIVE_COUNT             CONFIG_TCP_SERVER_KEEPALIVE_COUNT        /*  Keep-alive probe packet retry count.    */
-
-static const int RX_BUF_SIZE = 6*1024;
-static const int UART_RX_BUF_SIZE = 6*1024;
+#define TCP_MAX_CLIENTS             CONFIG_TCP_SERVER_MAX_CLIENTS            /*  Clients connected at the same time. The first is owner, the others observers */
+#define TCP_CLIENT_BUF_SIZE         CONFIG_TCP_SERVER_CLIENT_BUFFER          /*  Uart data held for a client that does not keep up, power of two */
+
+#define UART_RX_BUF_SIZE        CONFIG_UART_BRIDGE_RX_BUFFER            /* Driver buffer for data from the sensor */
+#define UART_TX_BUF_SIZE        2048            /* Data from the owner waiting to be sent on uart, the bridge does not wait for it */
+#define BRIDGE_BUF_SIZE         1024            /* Buffer shared by both directions of the bridge */
+#define UART_RX_IDLE_SYMBOLS    3               /* Forward received data when the line has been idle this many symbols */
+#define UART_VFS_PATH           "/dev/uart/2"   /* EX_UART_NUM in the VFS, to wait for it with select() */
+#define UART_QUERY_TIMEOUT_MS   200             /* Time for the sensor to answer get_clock() and get_node_description() */
+#define UART_BAUD_DEFAULT       CONFIG_UART_BRIDGE_BAUD_RATE            /* After boot, and when the last client is gone */
+#define UART_BAUD_MIN           1200
+#define UART_BAUD_MAX           5000000         /* APB clock / 16 */
+#define UART_BAUD_FAST          460800          /* Above this the 128 byte RX FIFO is emptied earlier */
+#define UART_RX_FULL_THRESH     100             /* RX FIFO level that raises the interrupt, up to UART_BAUD_FAST */
+#define UART_RX_FULL_THRESH_FAST 64             /* and above. Leaves 64 bytes, 213 us at 3 Mbaud, for the interrupt */
+#define UART_RTS_THRESH         110             /* RX FIFO level that stops the sensor with RTS */
 
 
                         //  RS232 adapter:       Colors   |   Pin
 #define TXD_PIN         (GPIO_NUM_27)        // yellow = RX = PIN 4   
 #define RXD_PIN         (GPIO_NUM_26)        // orange = TX = PIN 3  
+#define RTS_PIN         CONFIG_UART_BRIDGE_RTS_PIN      // -1 = not connected
+#define CTS_PIN         CONFIG_UART_BRIDGE_CTS_PIN      // -1 = not connected
 #define EX_UART_NUM     UART_NUM_2
+#define UART_HW_FLOW_CTRL   (RTS_PIN >= 0 && CTS_PIN >= 0)  /* RTS/CTS, else xon/xoff */
 
 
 
-/*/////////////////////////////////////////////////////////
- *
- *          TASK for receiving data on UART 
- *          and transmitting incomming data to a TCP socket
- *
- */
-void rx_task(void *arg);
-
-
 /*/////////////////////////////////////////////////////////          
- *          Init uart with xon/xoff flowcontrol
- *          .baud_rate = 115200,
+ *          Init uart with RTS/CTS flowcontrol if the pins are
+ *          set in menuconfig, else xon/xoff
+ *          .baud_rate = UART_BAUD_DEFAULT,
  *          .data_bits = UART_DATA_8_BITS,
  *          .parity    = UART_PARITY_DISABLE,
  *          .stop_bits = UART_STOP_BITS_1,
+ *          The driver is installed with a TX buffer and a
+ *          rx timeout of UART_RX_IDLE_SYMBOLS.
+ *          Called by uart_arbiter_start(), the driver is then
+ *          kept installed.
  */
 void uart_init(void);
 
+/*//////////////////////////////////////////////////////////
+ *          Change the baud rate of the installed driver,
+ *          after the data waiting to be sent is sent.
+ *          Only the uart, not the sensor, see
+ *          uart_arbiter_set_baud()
+ */
+void uart_set_speed(uint32_t baud);
+
 /*//////////////////////////////////////////////////////////
  *
  *                  Main tcp server task.
- *                  received data on a connected socket will
- *                  be directly retransmittet on UART
+ *                  One select() loop for the listening socket,
+ *                  the clients and the UART, so no other task is
+ *                  needed for the bridge.
+ *                  Up to TCP_MAX_CLIENTS can connect. Data
+ *                  received from the owner (the first client)
+ *                  is directly retransmittet on UART, data from
+ *                  observers is discarded. UART data is sent to
+ *                  all clients.
  *
  */
 void start_tcp_server_task(void);
 
+/*//////////////////////////////////////////////////////////
+ *
+ *           Close the listening socket and the connection,
+ *           before deep sleep, and wait up to timeout_ms for
+ *           the server task to end. Returns true if it ended,
+ *           or was not started
+ */
+bool stop_tcp_server(uint32_t timeout_ms);
+
 
 /*//////////////////////////////////////////////////////////
  *
@@ -64,13 +102,17 @@ uint8_t write_to_nvs(char *in_string);
 
 /*//////////////////////////////////////////////////////////
  *
- *           Send get_node desciprtion command to UART
+ *           Send get_node desciprtion command to UART.
+ *           Runs as a transaction of the uart arbiter, so it
+ *           can be used while the TCP bridge is running
  */ 
 uint8_t get_node_description(char * out_string, size_t max_tries);
 
 /*//////////////////////////////////////////////////////////
  *
- *           Send do_get clock command to UART
+ *           Send do_get clock command to UART, and set the
+ *           system time. Runs as a transaction of the uart
+ *           arbiter, so it can be used at any time
  */ 
 uint8_t get_clock(size_t n_times);
 
@@ -61,6 +61,7 @@ Contains the freeRTOS task and all necessary support
 #include "wifi_manager.h"
 #include "file_server.h"
 #include "uart_tcp_server.h"
+#include "shutdown.h"
 
 
 
@@ -159,16 +160,8 @@ void wifi_sleep_timer_cb( TimerHandle_t xTimer)
     TickType_t time_tick = xTimerGetExpiryTime  (xTimer);
     ESP_LOGI(TAG, "Sleep timer triggered after %u ms\nPrepare to enter sleep!", pdTICKS_TO_MS(time_tick));
 
-    esp_wifi_stop();
-	esp_wifi_deinit();
-
-    // Isolate GPIO pin from external circuits. This is needed for modules
-    // which have an external pull-up resistors on GPIO12
-    // to minimize current consumption in sleep mode.
-    rtc_gpio_isolate(GPIO_NUM_12);
-
-    //esp_sleep_pd_config(ESP_PD_DOMAIN_MAX, ESP_PD_OPTION_OFF);
-    esp_deep_sleep_start();
+    // The timer service task must not block, the shutdown runs in the sleep task
+    shutdown_request_sleep("Wi-Fi sleep timer");
 }
 
 void wifi_manager_timer_retry_cb( TimerHandle_t xTimer ){
@@ -0,0 +1,226 @@
+/*  ESP-IDF functions used by the SD writer, implemented for the host build.
+ *
+ *  Only what the SD writer needs to run against a directory: the clock, mutexes, POSIX backed FATFS files and
+ *  stubs for sleep and read back, which are not replayed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "host_compat.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "sdmmc.h"
+#include "ff.h"
+#include "spi_reader.h"
+#include "shutdown.h"
+
+
+static atomic_llong time_offset;            // Added to the clock by shim_advance_time()
+
+int64_t esp_timer_get_time(void)
+{
+    static int64_t start = 0;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t now = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    if (start == 0) {
+        start = now;
+    }
+    return now - start + atomic_load(&time_offset);
+}
+
+void shim_advance_time(int64_t us)
+{
+    atomic_fetch_add(&time_offset, us);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    pthread_exit(NULL);
+}
+
+void vTaskSuspend(TaskHandle_t task)
+{
+    while (1) {
+        pause();
+    }
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return (TaskHandle_t)pthread_self();
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    return pdPASS;          // spi_get_received() of the replay waits on a condition variable, not a notification
+}
+
+/* A mutex, or a binary semaphore that can be given from another thread */
+struct shim_mutex {
+    pthread_mutex_t mutex;
+    pthread_cond_t given;
+    bool binary;
+    bool available;
+};
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    SemaphoreHandle_t m = calloc(1, sizeof(*m));
+    if (m != NULL) {
+        pthread_mutex_init(&m->mutex, NULL);
+    }
+    return m;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    SemaphoreHandle_t m = xSemaphoreCreateMutex();
+    if (m != NULL) {
+        pthread_cond_init(&m->given, NULL);
+        m->binary = true;
+    }
+    return m;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t m, TickType_t ticks_to_wait)
+{
+    pthread_mutex_lock(&m->mutex);
+    if (!m->binary) {
+        return pdTRUE;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ticks_to_wait / 1000;
+    deadline.tv_nsec += (ticks_to_wait % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (!m->available && pthread_cond_timedwait(&m->given, &m->mutex, &deadline) == 0) {
+    }
+    BaseType_t taken = m->available ? pdTRUE : pdFALSE;
+    m->available = false;
+    pthread_mutex_unlock(&m->mutex);
+    return taken;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t m)
+{
+    if (m->binary) {
+        pthread_mutex_lock(&m->mutex);
+        m->available = true;
+        pthread_cond_signal(&m->given);
+    }
+    pthread_mutex_unlock(&m->mutex);
+    return pdTRUE;
+}
+
+void shutdown_enter_sleep(const char *reason)
+{
+    printf("Deep sleep is not replayed, continuing (%s)\n", reason);
+}
+
+void spi_reader_open(const char *path)
+{
+    printf("Read back is not replayed: %s\n", path);
+}
+
+void spi_reader_seek(uint32_t offset)
+{
+}
+
+uint8_t get_fat_path(char *dest, const char *path, size_t destsize)
+{
+    return strlcpy(dest, path, destsize) < destsize;
+}
+
+#if defined(__GLIBC__) && (__GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38))
+size_t strlcpy(char *dst, const char *src, size_t size)
+{
+    size_t len = strlen(src);
+
+    if (size > 0) {
+        size_t n = len < size - 1 ? len : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return len;
+}
+#endif
+
+FRESULT f_open(FIL *fp, const char *path, BYTE mode)
+{
+    int flags = (mode & FA_WRITE) ? ((mode & FA_READ) ? O_RDWR : O_WRONLY) : O_RDONLY;
+    struct stat st;
+
+    if (mode & (FA_OPEN_ALWAYS | FA_CREATE_ALWAYS | FA_CREATE_NEW)) {
+        flags |= O_CREAT;
+    }
+    if ((mode & FA_CREATE_ALWAYS) == FA_CREATE_ALWAYS) {
+        flags |= O_TRUNC;
+    }
+    fp->fd = open(path, flags, 0666);
+    if (fp->fd < 0) {
+        return FR_NO_FILE;
+    }
+    fstat(fp->fd, &st);
+    fp->obj.objsize = st.st_size;
+    fp->fptr = (mode & FA_OPEN_APPEND) == FA_OPEN_APPEND ? fp->obj.objsize : 0;
+    return FR_OK;
+}
+
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw)
+{
+    ssize_t n = pwrite(fp->fd, buff, btw, fp->fptr);
+
+    *bw = n > 0 ? n : 0;
+    fp->fptr += *bw;
+    if (fp->fptr > fp->obj.objsize) {
+        fp->obj.objsize = fp->fptr;
+    }
+    return n == (ssize_t)btw ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT f_lseek(FIL *fp, FSIZE_t ofs)
+{
+    if (ofs > fp->obj.objsize) {
+        if (ftruncate(fp->fd, ofs) != 0) {
+            return FR_DISK_ERR;
+        }
+        fp->obj.objsize = ofs;
+    }
+    fp->fptr = ofs;
+    return FR_OK;
+}
+
+FRESULT f_truncate(FIL *fp)
+{
+    if (ftruncate(fp->fd, fp->fptr) != 0) {
+        return FR_DISK_ERR;
+    }
+    fp->obj.objsize = fp->fptr;
+    return FR_OK;
+}
+
+FRESULT f_sync(FIL *fp)
+{
+    return fsync(fp->fd) == 0 ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT f_close(FIL *fp)
+{
+    return close(fp->fd) == 0 ? FR_OK : FR_DISK_ERR;
+}
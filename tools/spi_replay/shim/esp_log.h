@@ -0,0 +1,13 @@
+/* Host build: log to stdout like the firmware does on the console */
+#pragma once
+
+#include <stdio.h>
+#include "esp_timer.h"
+
+#define SHIM_LOG(level, tag, format, ...) \
+    printf(level " (%lli) %s: " format "\n", (long long)(esp_timer_get_time() / 1000), tag, ##__VA_ARGS__)
+
+#define ESP_LOGE(tag, format, ...)  SHIM_LOG("E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)  SHIM_LOG("W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)  SHIM_LOG("I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)  do { } while (0)
@@ -0,0 +1,10 @@
+/* Host build: time since start of the replay, in micro seconds */
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+int64_t esp_timer_get_time(void);
+
+/* Move the clock forward, so the SD writer sees an idle timeout at the end of a replay */
+void shim_advance_time(int64_t us);
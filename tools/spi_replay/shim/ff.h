@@ -0,0 +1,48 @@
+/* Host build: the part of the FATFS API used by the SD writer, on POSIX files.
+ * Seeking past the end of a file open for writing extends it, as FATFS does. */
+#pragma once
+
+#include <stdint.h>
+
+typedef unsigned int UINT;
+typedef uint8_t BYTE;
+typedef uint32_t FSIZE_t;
+
+typedef enum {
+    FR_OK = 0,
+    FR_DISK_ERR,
+    FR_INT_ERR,
+    FR_NOT_READY,
+    FR_NO_FILE,
+    FR_NO_PATH,
+    FR_INVALID_NAME,
+    FR_DENIED,
+} FRESULT;
+
+#define FA_READ             0x01
+#define FA_WRITE            0x02
+#define FA_OPEN_EXISTING    0x00
+#define FA_CREATE_NEW       0x04
+#define FA_CREATE_ALWAYS    0x08
+#define FA_OPEN_ALWAYS      0x10
+#define FA_OPEN_APPEND      0x30
+
+typedef struct {
+    FSIZE_t objsize;        /* Size in the directory entry, as in FATFS */
+} FFOBJID;
+
+typedef struct {
+    FFOBJID obj;
+    int fd;
+    FSIZE_t fptr;
+} FIL;
+
+#define f_tell(fp)          ((fp)->fptr)
+#define f_size(fp)          ((fp)->obj.objsize)
+
+FRESULT f_open(FIL *fp, const char *path, BYTE mode);
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw);
+FRESULT f_lseek(FIL *fp, FSIZE_t ofs);
+FRESULT f_truncate(FIL *fp);
+FRESULT f_sync(FIL *fp);
+FRESULT f_close(FIL *fp);
@@ -0,0 +1,15 @@
+/* Host build: the FreeRTOS types used by the SD writer */
+#pragma once
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE                  1
+#define pdFALSE                 0
+#define pdPASS                  pdTRUE
+#define portMAX_DELAY           ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS      1
+#define pdMS_TO_TICKS(ms)       ((TickType_t)(ms))
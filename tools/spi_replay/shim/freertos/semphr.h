@@ -0,0 +1,11 @@
+/* Host build: mutexes are pthread mutexes, binary semaphores add a condition variable */
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct shim_mutex *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t ticks_to_wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex);
@@ -0,0 +1,10 @@
+/* Configuration of the host build, same values as the sdkconfig of the firmware.
+ * CONFIG_SPI_PROTOCOL_V2 is set from CMake, to match the capture. */
+#pragma once
+
+#define CONFIG_SPI_RX_POOL_BUFFERS      8
+#define CONFIG_SPI_QUEUE_DEPTH          4
+#define CONFIG_SPI_SYNC_BYTES           262144
+#define CONFIG_SPI_SYNC_INTERVAL_MS     500
+#define CONFIG_SPI_ROTATE_BYTES         16777216
+#define CONFIG_SPI_ROTATE_SECONDS       3600
@@ -0,0 +1,12 @@
+/* Host build: the card is a directory. The replay tool changes to it, so the mount point is "." */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#define SD_MOUNT        "."
+#define SD_MAX_FILES    10
+
+/* FATFS paths are the same paths, ff.h is implemented on POSIX files */
+uint8_t get_fat_path(char *dest, const char *path, size_t destsize);
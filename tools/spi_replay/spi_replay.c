@@ -0,0 +1,458 @@
+/*  Replay of SPI captures on the host.
+ *
+ *  Runs the SD writer of the firmware (main/sd_writer.c) against a directory, fed with the packets of a capture
+ *  made with CONFIG_SPI_CAPTURE. This file takes the place of spi.c: the main thread receives the packets into a
+ *  pool of buffers like the SPI task does, and the SD writer task runs in its own thread.
+ *
+ *  Usage: spi_replay [-t] [-s speed] [-p buffers] [-v] capture.bin directory
+ *      -t  Replay with the timing of the capture, so buffer occupancy can be compared with the device.
+ *          Default is to replay as fast as the SD writer takes the packets.
+ *      -s  Speed factor with -t. 2 replays twice as fast as captured
+ *      -p  Number of receive buffers. Default is the pool size of the firmware that made the capture
+ *      -v  Show the output of the SD writer
+ *
+ *  Reports throughput, time the SD writer spends on each packet by command, and a histogram of the packets
+ *  waiting for the SD writer when a packet is received, next to the one recorded on the device.
+ *  To replay against a FAT file system, mount an image (losetup/mount or a FUSE driver) and give its mount point.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "spi.h"
+#include "spi_capture.h"
+#include "sd_writer.h"
+
+
+#define KIND_DATA           256         // Follow-on packet of a WRITEFILE, no header
+#define KINDS               257
+#define MAX_POOL            255
+#define BAR_WIDTH           30
+
+/* A pool buffer. spi_buffer_t comes first, so the SD writer's pointer can be cast back */
+typedef struct replay_buffer {
+    spi_buffer_t buf;
+    int kind;                   // Command byte, or KIND_DATA
+    int64_t start;              // Time the SD writer took the packet
+} replay_buffer_t;
+
+typedef struct samples {
+    uint32_t *us;
+    size_t count;
+    size_t size;
+} samples_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed;
+
+static replay_buffer_t *pool;
+static int pool_size;
+static replay_buffer_t **free_buffers;      // Stack of free buffers
+static int free_count = 0;
+static replay_buffer_t **received;          // FIFO of packets for the SD writer
+static int received_head = 0;
+static int received_count = 0;
+static bool producer_done = false;          // All packets of the capture are received
+static bool drained = false;                // The SD writer has been sent into its idle timeout
+
+static samples_t latency[KINDS];
+static uint64_t occupancy[MAX_POOL + 1];    // Packets waiting when a packet is received, replay
+static uint64_t device_occupancy[256];      // Same, recorded on the device
+static uint32_t stalls = 0;                 // Packets that had to wait for a free buffer
+static int64_t stall_us = 0;
+
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void add_sample(samples_t *s, int64_t us)
+{
+    if (s->count == s->size) {
+        s->size = s->size ? s->size * 2 : 1024;
+        s->us = realloc(s->us, s->size * sizeof(uint32_t));
+        if (s->us == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    s->us[s->count++] = MIN(us, UINT32_MAX);
+}
+
+/* Same bookkeeping as the follow-on packets (follow_remaining) in spi_dispatch_packet() of spi_dispatch.c, to tell
+ * WRITEFILE data packets from commands */
+static int packet_kind(const uint8_t *data, uint16_t len)
+{
+    static size_t write_remaining = 0;
+
+    if (write_remaining > 0) {
+        write_remaining -= MIN(SPI_BLOCK_SIZE, write_remaining);
+        return KIND_DATA;
+    }
+    if (len < SPI_HEADER_SIZE) {
+        return data[0];
+    }
+    uint16_t length = (data[2] << 8) | data[1];
+    if (data[0] == WRITEFILE && length > SPI_BLOCK_SIZE) {
+        write_remaining = length - SPI_BLOCK_SIZE;
+    }
+    return data[0];
+}
+
+static const char *kind_name(int kind)
+{
+    static char name[8];
+
+    switch (kind) {
+        case KIND_DATA:         return "data";
+        case OPEN_FILE:         return "OPEN_FILE";
+        case CLOSE_FILE:        return "CLOSE_FILE";
+        case WRITEFILE:         return "WRITEFILE";
+        case SYNCFILE:          return "SYNCFILE";
+        case SLEEP:             return "SLEEP";
+        case WAKEUP:            return "WAKEUP";
+        case MAKEDIR:           return "MAKEDIR";
+        case OPEN_FILE_EX:      return "OPEN_FILE_EX";
+        case SET_QUEUE_DEPTH:   return "SET_QUEUE_DEPTH";
+        case BATCH:             return "BATCH";
+        case READ_OPEN:         return "READ_OPEN";
+        case READ_BLOCK:        return "READ_BLOCK";
+        default:
+            snprintf(name, sizeof(name), "0x%02X", kind);
+            return name;
+    }
+}
+
+
+/* The SPI receiver API used by the SD writer */
+
+spi_buffer_t *spi_get_received(TickType_t ticks_to_wait)
+{
+    struct timespec deadline;
+    int64_t until = now_us() + (int64_t)ticks_to_wait * portTICK_PERIOD_MS * 1000;
+    deadline.tv_sec = until / 1000000;
+    deadline.tv_nsec = (until % 1000000) * 1000;
+
+    pthread_mutex_lock(&lock);
+    while (received_count == 0 && !producer_done) {
+        if (ticks_to_wait == portMAX_DELAY) {
+            pthread_cond_wait(&changed, &lock);
+        } else if (pthread_cond_timedwait(&changed, &lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    if (received_count == 0 && producer_done) {
+        if (drained) {
+            // The SD writer has closed its files after the last packet, the replay is done
+            pthread_mutex_unlock(&lock);
+            pthread_exit(NULL);
+        }
+        // Let the SD writer time out, so it closes its files as after the last packet on the device
+        drained = true;
+        pthread_mutex_unlock(&lock);
+        shim_advance_time((SD_WRITER_IDLE_TIMEOUT_MS + 1000) * 1000LL);
+        return NULL;
+    }
+    if (received_count == 0) {
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+
+    replay_buffer_t *rb = received[received_head];
+    received_head = (received_head + 1) % pool_size;
+    received_count--;
+    pthread_mutex_unlock(&lock);
+
+    rb->start = now_us();
+    return &rb->buf;
+}
+
+void spi_release_buffer(spi_buffer_t *buf)
+{
+    replay_buffer_t *rb = (replay_buffer_t *)buf;
+    int64_t us = now_us() - rb->start;
+
+    pthread_mutex_lock(&lock);
+    add_sample(&latency[rb->kind], us);
+    free_buffers[free_count++] = rb;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+}
+
+bool spi_set_queue_depth(int depth)
+{
+    return depth >= 1 && depth <= MAX_SPI_MESSAGES;
+}
+
+void spi_save_state(void)
+{
+}
+
+
+/* Take a free buffer, waiting for the SD writer if there is none. On the device the master waits for the handshake */
+static replay_buffer_t *take_buffer(void)
+{
+    pthread_mutex_lock(&lock);
+    occupancy[received_count]++;
+    if (free_count == 0) {
+        int64_t start = now_us();
+        stalls++;
+        while (free_count == 0) {
+            pthread_cond_wait(&changed, &lock);
+        }
+        stall_us += now_us() - start;
+    }
+    replay_buffer_t *rb = free_buffers[--free_count];
+    pthread_mutex_unlock(&lock);
+    return rb;
+}
+
+static void hand_over(replay_buffer_t *rb)
+{
+    pthread_mutex_lock(&lock);
+    rb->buf.backlog = received_count;
+    received[(received_head + received_count) % pool_size] = rb;
+    received_count++;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+}
+
+static void *writer_thread(void *arg)
+{
+    sd_writer_task(NULL);
+    return NULL;
+}
+
+static int compare_us(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const samples_t *s, int p)
+{
+    return s->us[(s->count - 1) * p / 100];
+}
+
+static void print_bar(FILE *out, uint64_t count, uint64_t max)
+{
+    int n = max ? (int)((count * BAR_WIDTH + max - 1) / max) : 0;
+    fprintf(out, " %10llu %-*.*s", (unsigned long long)count, BAR_WIDTH, n,
+            "##############################");
+}
+
+static void report(FILE *out, uint64_t packets, uint64_t bytes, int64_t elapsed_us, int boots)
+{
+    sd_writer_stats_t stats;
+    sd_writer_get_stats(&stats);
+    double seconds = elapsed_us / 1e6;
+
+    fprintf(out, "\nReplayed %llu packets, %.2f MB in %.3f s: %.2f MB/s", (unsigned long long)packets,
+            bytes / 1e6, seconds, seconds > 0 ? bytes / 1e6 / seconds : 0);
+    fprintf(out, "  (%i boot%s in capture)\n", boots, boots == 1 ? "" : "s");
+    fprintf(out, "Written to files: %.2f MB from %.2f MB of file data, %u writes, %.3f s in write calls\n",
+            stats.bytes / 1e6, stats.input_bytes / 1e6, stats.writes, stats.write_us / 1e6);
+    fprintf(out, "Syncs: %u, %.3f s total, longest %.2f ms\n", stats.syncs, stats.sync_us / 1e6, stats.sync_max_us / 1e3);
+    fprintf(out, "Stalls: %u packets waited %.3f s for a free buffer (%i buffers)\n", stalls, stall_us / 1e6, pool_size);
+
+    fprintf(out, "\nTime per packet (us)        count        p50        p90        p99        max\n");
+    for (int k = 0; k < KINDS; k++) {
+        samples_t *s = &latency[k];
+        if (s->count == 0) {
+            continue;
+        }
+        qsort(s->us, s->count, sizeof(uint32_t), compare_us);
+        fprintf(out, "  %-18s %10zu %10u %10u %10u %10u\n", kind_name(k), s->count,
+                percentile(s, 50), percentile(s, 90), percentile(s, 99), s->us[s->count - 1]);
+    }
+
+    uint64_t max = 0, device_max = 0;
+    int rows = pool_size;
+    for (int i = 0; i < 256; i++) {
+        if (i <= MAX_POOL) {
+            max = MAX(max, occupancy[i]);
+        }
+        device_max = MAX(device_max, device_occupancy[i]);
+        if (device_occupancy[i] > 0) {
+            rows = MAX(rows, i);
+        }
+    }
+    fprintf(out, "\nPackets waiting for the SD writer when a packet is received\n");
+    fprintf(out, "  waiting %*s %-*s %*s\n", 10, "replay", BAR_WIDTH, "", 10, "device");
+    for (int i = 0; i <= rows && i <= MAX_POOL; i++) {
+        fprintf(out, "  %7i", i);
+        print_bar(out, occupancy[i], max);
+        print_bar(out, device_occupancy[i], device_max);
+        fprintf(out, "\n");
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: spi_replay [-t] [-s speed] [-p buffers] [-v] capture.bin directory\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    bool timed = false;
+    bool verbose = false;
+    double speed = 1.0;
+    int buffers = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ts:p:v")) != -1) {
+        switch (opt) {
+            case 't': timed = true; break;
+            case 's': speed = atof(optarg); break;
+            case 'p': buffers = atoi(optarg); break;
+            case 'v': verbose = true; break;
+            default: usage();
+        }
+    }
+    if (argc - optind != 2 || speed <= 0) {
+        usage();
+    }
+
+    FILE *capture = fopen(argv[optind], "rb");
+    if (capture == NULL) {
+        fprintf(stderr, "Cannot open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    spi_capture_header_t header;
+    if (fread(&header, sizeof(header), 1, capture) != 1 || header.magic != SPI_CAPTURE_MAGIC ||
+        header.version != SPI_CAPTURE_VERSION) {
+        fprintf(stderr, "%s is not a SPI capture\n", argv[optind]);
+        return 1;
+    }
+    if (header.header_size != SPI_HEADER_SIZE || header.block_size != SPI_BLOCK_SIZE) {
+        fprintf(stderr, "Capture has %u byte headers and %u byte blocks, this build %u and %u. "
+                "Build with -DSPI_PROTOCOL_V2=%s\n", header.header_size, header.block_size, SPI_HEADER_SIZE,
+                SPI_BLOCK_SIZE, header.header_size == SPI_HEADER_SIZE ? "OFF" : "ON");
+        return 1;
+    }
+
+    pool_size = buffers > 0 ? buffers : header.pool_size;
+    if (pool_size < 1 || pool_size > MAX_POOL) {
+        fprintf(stderr, "Number of buffers must be 1 - %i\n", MAX_POOL);
+        return 1;
+    }
+    pool = calloc(pool_size, sizeof(replay_buffer_t));
+    free_buffers = calloc(pool_size, sizeof(replay_buffer_t *));
+    received = calloc(pool_size, sizeof(replay_buffer_t *));
+    if (pool == NULL || free_buffers == NULL || received == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < pool_size; i++) {
+        pool[i].buf.data = malloc(SPI_TRANS_SIZE);
+        if (pool[i].buf.data == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        free_buffers[free_count++] = &pool[i];
+    }
+
+    // The SD writer writes below SD_MOUNT, which is "." in the host build
+    if (mkdir(argv[optind + 1], 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create %s: %s\n", argv[optind + 1], strerror(errno));
+        return 1;
+    }
+    if (chdir(argv[optind + 1]) != 0) {
+        fprintf(stderr, "Cannot change to %s: %s\n", argv[optind + 1], strerror(errno));
+        return 1;
+    }
+
+    // The report goes to stdout, the output of the SD writer only with -v
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || (!verbose && freopen("/dev/null", "w", stdout) == NULL)) {
+        fprintf(stderr, "Cannot redirect output\n");
+        return 1;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&changed, &attr);
+
+    esp_timer_get_time();       // Start the clock of the firmware
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+        fprintf(stderr, "Cannot start the SD writer\n");
+        return 1;
+    }
+
+    uint8_t *data = malloc(SPI_TRANS_SIZE);
+    uint64_t packets = 0, bytes = 0;
+    int boots = 0;
+    bool synced = false;            // capture_start and replay_start refer to the same packet
+    int64_t capture_start = 0, replay_start = 0, start = 0;
+    spi_capture_record_t record;
+
+    while (fread(&record, sizeof(record), 1, capture) == 1) {
+        if (record.type == SPI_CAPTURE_BOOT) {
+            boots++;
+            synced = false;         // Time starts from 0 again, the time asleep is not known
+            continue;
+        }
+        if (record.type != SPI_CAPTURE_PACKET || record.len > SPI_TRANS_SIZE ||
+            fread(data, 1, record.len, capture) != record.len) {
+            fprintf(stderr, "Capture is corrupt or truncated after %llu packets\n", (unsigned long long)packets);
+            break;
+        }
+
+        if (timed) {
+            if (!synced) {
+                capture_start = record.time;
+                replay_start = now_us();
+                synced = true;
+            }
+            int64_t wait = replay_start + (int64_t)((record.time - capture_start) / speed) - now_us();
+            if (wait > 0) {
+                usleep(wait);
+            }
+        }
+        device_occupancy[record.backlog]++;
+
+        replay_buffer_t *rb = take_buffer();
+        if (packets == 0) {
+            start = now_us();
+        }
+        memcpy(rb->buf.data, data, record.len);
+        rb->buf.len = record.len;
+        rb->buf.time = esp_timer_get_time();
+        rb->kind = packet_kind(data, record.len);
+        hand_over(rb);
+
+        packets++;
+        bytes += record.len;
+    }
+    fclose(capture);
+
+    pthread_mutex_lock(&lock);
+    producer_done = true;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+    fflush(stdout);
+
+    report(out, packets, bytes, packets ? now_us() - start : 0, boots);
+    fclose(out);
+    return 0;
+}